@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+#include "rfb/rfbregion.h"
+
+#include "continuous.h"
+#include "logging.h"
+
+/*
+ * ContinuousUpdates and Fence, as TigerVNC and noVNC speak them; the
+ * libvncserver in use knows neither. A client with continuous updates on
+ * keeps its region in requestedRegion, so every capture that finds changes
+ * there is sent without waiting for a FramebufferUpdateRequest. A fence
+ * follows each update and the client answers it once the update is
+ * processed; with CU_WINDOW updates unanswered the region is not re-armed
+ * until an answer comes, so a slow link does not pile up frames.
+ */
+
+#define CU_ENCODING    0xFFFFFEC7 /* -313 */
+#define FENCE_ENCODING 0xFFFFFEC8 /* -312 */
+
+#define MSG_CONTINUOUS 150 /* EnableContinuousUpdates / EndOfContinuousUpdates */
+#define MSG_FENCE      248
+
+#define FENCE_BLOCK_BEFORE (1u << 0)
+#define FENCE_BLOCK_AFTER  (1u << 1)
+#define FENCE_SYNC_NEXT    (1u << 2)
+#define FENCE_REQUEST      (1u << 31)
+#define FENCE_MAX_PAYLOAD  64
+
+/* updates in flight before the client has to confirm one */
+#define CU_WINDOW 2
+
+struct cu_client
+{
+    int has_cu;       /* EndOfContinuousUpdates announced */
+    int has_fence;
+    int enabled;
+    sraRegionPtr region;
+    int in_flight;    /* fences sent and not answered yet */
+    uint32_t seq;
+    int sent_before;  /* bytes sent before the update, -1 - no update begun */
+};
+
+/* the screen's own displayHook, called on from update_starts() */
+static rfbDisplayHookPtr chained_display_hook;
+
+static rfbBool cu_new_client(rfbClientPtr cl, void **data);
+static rfbBool cu_enable_encoding(rfbClientPtr cl, void **data, int encoding);
+static rfbBool cu_handle_message(rfbClientPtr cl, void *data, const rfbClientToServerMsg *msg);
+static void cu_close(rfbClientPtr cl, void *data);
+
+static int cu_encodings[] = { (int)CU_ENCODING, (int)FENCE_ENCODING, 0 };
+
+static rfbProtocolExtension cu_extension = {
+    cu_new_client,
+    NULL,
+    cu_encodings,
+    cu_enable_encoding,
+    cu_handle_message,
+    cu_close,
+    NULL,
+    NULL,
+    NULL
+};
+
+static rfbBool send_fence(rfbClientPtr cl, uint32_t flags, int len, const char *payload)
+{
+    char buf[9 + FENCE_MAX_PAYLOAD];
+
+    memset(buf, 0, 4);
+    buf[0] = MSG_FENCE;
+    flags = Swap32IfLE(flags);
+    memcpy(buf + 4, &flags, 4);
+    buf[8] = len;
+    memcpy(buf + 9, payload, len);
+
+    if (rfbWriteExact(cl, buf, 9 + len) < 0)
+    {
+        rfbLogPerror("send_fence: write");
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static rfbBool send_end_of_cu(rfbClientPtr cl)
+{
+    char type = MSG_CONTINUOUS;
+
+    if (rfbWriteExact(cl, &type, 1) < 0)
+    {
+        rfbLogPerror("send_end_of_cu: write");
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Asks for the next update of the continuous region, as a request would */
+static void rearm(rfbClientPtr cl, struct cu_client *cu)
+{
+    if (cu->enabled && (!cu->has_fence || cu->in_flight < CU_WINDOW))
+        sraRgnOr(cl->requestedRegion, cu->region);
+}
+
+static rfbBool cu_new_client(rfbClientPtr cl, void **data)
+{
+    struct cu_client *cu = calloc(1, sizeof(struct cu_client));
+
+    (void)cl;
+    if (cu == NULL)
+        return FALSE;
+    cu->region = sraRgnCreate();
+    cu->sent_before = -1;
+    *data = cu;
+    return TRUE;
+}
+
+static void cu_close(rfbClientPtr cl, void *data)
+{
+    struct cu_client *cu = data;
+
+    (void)cl;
+    if (cu == NULL)
+        return;
+    sraRgnDestroy(cu->region);
+    free(cu);
+}
+
+/* Support of both is announced the way the protocol asks for it */
+static rfbBool cu_enable_encoding(rfbClientPtr cl, void **data, int encoding)
+{
+    struct cu_client *cu = *data;
+
+    if (cu == NULL)
+        return FALSE;
+
+    if ((uint32_t)encoding == CU_ENCODING)
+    {
+        if (!cu->has_cu)
+        {
+            cu->has_cu = 1;
+            send_end_of_cu(cl);
+        }
+        return TRUE;
+    }
+    if ((uint32_t)encoding == FENCE_ENCODING)
+    {
+        if (!cu->has_fence)
+        {
+            char probe = 0;
+            cu->has_fence = 1;
+            send_fence(cl, FENCE_REQUEST, 1, &probe);
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static rfbBool enable_cu(rfbClientPtr cl, struct cu_client *cu)
+{
+    char buf[9];
+    uint16_t x, y, w, h;
+    int sw = cl->scaledScreen->width, sh = cl->scaledScreen->height;
+    int x1, y1, x2, y2;
+
+    if (rfbReadExact(cl, buf, 9) <= 0)
+    {
+        rfbCloseClient(cl);
+        return TRUE;
+    }
+    memcpy(&x, buf + 1, 2);
+    memcpy(&y, buf + 3, 2);
+    memcpy(&w, buf + 5, 2);
+    memcpy(&h, buf + 7, 2);
+    x = Swap16IfLE(x);
+    y = Swap16IfLE(y);
+    w = Swap16IfLE(w);
+    h = Swap16IfLE(h);
+
+    if (!buf[0])
+    {
+        cu->enabled = 0;
+        sraRgnMakeEmpty(cu->region);
+        send_end_of_cu(cl);
+        return TRUE;
+    }
+
+    /* the rect is in the client's scaled coordinates */
+    x1 = x * cl->screen->width / sw;
+    y1 = y * cl->screen->height / sh;
+    x2 = ((x + w) * cl->screen->width + sw - 1) / sw;
+    y2 = ((y + h) * cl->screen->height + sh - 1) / sh;
+    if (x2 > cl->screen->width)
+        x2 = cl->screen->width;
+    if (y2 > cl->screen->height)
+        y2 = cl->screen->height;
+
+    sraRgnDestroy(cu->region);
+    cu->region = sraRgnCreateRect(x1, y1, x2, y2);
+    cu->enabled = 1;
+    rearm(cl, cu);
+    return TRUE;
+}
+
+static rfbBool handle_fence(rfbClientPtr cl, struct cu_client *cu)
+{
+    char buf[8 + FENCE_MAX_PAYLOAD];
+    uint32_t flags;
+    int len;
+
+    if (rfbReadExact(cl, buf, 8) <= 0)
+    {
+        rfbCloseClient(cl);
+        return TRUE;
+    }
+    memcpy(&flags, buf + 3, 4);
+    flags = Swap32IfLE(flags);
+    len = (uint8_t)buf[7];
+    if (len > FENCE_MAX_PAYLOAD)
+    {
+        rfbErr("fence payload of %d bytes from %s\n", len, cl->host);
+        rfbCloseClient(cl);
+        return TRUE;
+    }
+    if (len > 0 && rfbReadExact(cl, buf + 8, len) <= 0)
+    {
+        rfbCloseClient(cl);
+        return TRUE;
+    }
+
+    if (flags & FENCE_REQUEST)
+    {
+        /* messages are handled in order, so every flag is honoured as is */
+        send_fence(cl, flags & (FENCE_BLOCK_BEFORE | FENCE_BLOCK_AFTER | FENCE_SYNC_NEXT), len, buf + 8);
+        return TRUE;
+    }
+
+    /* answer to one of ours, the probe has a 1 byte payload */
+    if (len == 4 && cu->in_flight > 0)
+    {
+        cu->in_flight--;
+        rearm(cl, cu);
+    }
+    return TRUE;
+}
+
+static rfbBool cu_handle_message(rfbClientPtr cl, void *data, const rfbClientToServerMsg *msg)
+{
+    struct cu_client *cu = data;
+
+    if (cu == NULL)
+        return FALSE;
+
+    switch (msg->type)
+    {
+    case MSG_CONTINUOUS:
+        return cu->has_cu ? enable_cu(cl, cu) : FALSE;
+    case MSG_FENCE:
+        return cu->has_fence ? handle_fence(cl, cu) : FALSE;
+    }
+    return FALSE;
+}
+
+static void update_starts(rfbClientPtr cl)
+{
+    struct cu_client *cu = rfbGetExtensionClientData(cl, &cu_extension);
+
+    if (cu != NULL)
+        cu->sent_before = rfbStatGetSentBytes(cl);
+    if (chained_display_hook != NULL)
+        chained_display_hook(cl);
+}
+
+/*
+ * After each update a fence, answered once the client has processed it.
+ * libvncserver calls this with result TRUE also when it found nothing to
+ * send; only an update that went out is fenced and counted.
+ */
+static void update_sent(rfbClientPtr cl, int result)
+{
+    struct cu_client *cu = rfbGetExtensionClientData(cl, &cu_extension);
+    uint32_t seq;
+    int sent_before;
+
+    if (cu == NULL)
+        return;
+    sent_before = cu->sent_before;
+    cu->sent_before = -1;
+    if (!cu->enabled || !result || cl->sock < 0)
+        return;
+    if (sent_before < 0 || rfbStatGetSentBytes(cl) == sent_before)
+    {
+        /* the request stands, nothing to confirm */
+        rearm(cl, cu);
+        return;
+    }
+
+    if (cu->has_fence)
+    {
+        if (cl->ublen > 0 && !rfbSendUpdateBuf(cl))
+            return;
+        seq = Swap32IfLE(cu->seq);
+        cu->seq++;
+        if (!send_fence(cl, FENCE_REQUEST | FENCE_BLOCK_BEFORE, 4, (char *)&seq))
+            return;
+        cu->in_flight++;
+    }
+    rearm(cl, cu);
+}
+
+void init_continuous(rfbScreenInfoPtr screen)
+{
+    rfbRegisterProtocolExtension(&cu_extension);
+    if (screen->displayHook != update_starts)
+    {
+        chained_display_hook = screen->displayHook;
+        screen->displayHook = update_starts;
+    }
+    screen->displayFinishedHook = update_sent;
+}
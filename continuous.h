@@ -0,0 +1,6 @@
+#ifndef CONTINUOUS_H
+#define CONTINUOUS_H
+
+void init_continuous(rfbScreenInfoPtr screen);
+
+#endif //CONTINUOUS_H
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "cpuctl.h"
+#include "logging.h"
+
+/* "0,2-3" */
+int parse_cpu_list(const char *value, struct thread_sched *ts)
+{
+    const char *p = value;
+
+    CPU_ZERO(&ts->cpus);
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return 0;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first || last >= CPU_SETSIZE)
+                return 0;
+            p = end;
+        }
+        for (; first <= last; first++)
+            CPU_SET(first, &ts->cpus);
+
+        while (*p == ',' || *p == ' ')
+            p++;
+    }
+
+    ts->has_cpus = CPU_COUNT(&ts->cpus) > 0;
+    ts->is_set = 1;
+    return ts->has_cpus;
+}
+
+int parse_sched_policy(const char *value, struct thread_sched *ts)
+{
+    if (strcmp(value, "other") == 0)
+        ts->policy = SCHED_OTHER;
+    else if (strcmp(value, "batch") == 0)
+        ts->policy = SCHED_BATCH;
+    else if (strcmp(value, "idle") == 0)
+        ts->policy = SCHED_IDLE;
+    else if (strcmp(value, "fifo") == 0)
+        ts->policy = SCHED_FIFO;
+    else if (strcmp(value, "rr") == 0)
+        ts->policy = SCHED_RR;
+    else
+        return 0;
+
+    ts->has_policy = 1;
+    ts->is_set = 1;
+    return 1;
+}
+
+/* nice -20..19 or rt priority 1..99, as the policy takes it */
+int parse_sched_priority(const char *value, struct thread_sched *ts)
+{
+    char *end;
+    long priority = strtol(value, &end, 10);
+
+    if (end == value || *end != '\0' || priority < -20 || priority > 99)
+        return 0;
+
+    ts->priority = priority;
+    ts->has_priority = 1;
+    ts->is_set = 1;
+    return 1;
+}
+
+/* Applies to the calling thread only */
+void apply_thread_sched(const struct thread_sched *ts, const char *name)
+{
+    struct sched_param param;
+    pid_t tid = syscall(SYS_gettid);
+
+    if (!ts->is_set)
+        return;
+
+    if (ts->has_cpus && sched_setaffinity(tid, sizeof(cpu_set_t), &ts->cpus) != 0)
+        error_print("%s: cannot set cpu affinity, %s\n", name, strerror(errno));
+
+    memset(&param, 0, sizeof(param));
+    if (ts->policy == SCHED_FIFO || ts->policy == SCHED_RR)
+        param.sched_priority = ts->priority;
+
+    if (ts->has_policy && sched_setscheduler(tid, ts->policy, &param) != 0)
+        error_print("%s: cannot set scheduling policy, %s\n", name, strerror(errno));
+
+    /* without a policy the priority is a nice value */
+    if (ts->has_priority && (ts->policy == SCHED_OTHER || ts->policy == SCHED_BATCH) &&
+        setpriority(PRIO_PROCESS, tid, ts->priority) != 0)
+        error_print("%s: cannot set nice %d, %s\n", name, ts->priority, strerror(errno));
+}
+
+/*
+ * CPU budget governor. The budget is a fraction of one core for the whole
+ * process, scan workers included. While over it the governor first stretches
+ * the capture cycle, once the stretch is at its limit it steps through the
+ * degrade levels (cheaper encoding, sparser scan), and it walks back down the
+ * same way when usage drops under the low watermark.
+ *
+ * If vncsrv is started inside a cgroup with a CPU quota, the budget is kept
+ * under that quota as well: hitting the quota makes the kernel freeze every
+ * thread, including input injection.
+ */
+static double budget = 0;
+static struct timespec win_wall;
+static struct timespec win_cpu;
+static int win_cycles = 0;
+static long extra_usec = 0;
+static int level = BUDGET_NORMAL;
+
+#define BUDGET_WINDOW 1.0    /* sec */
+#define BUDGET_LOW 0.7       /* fraction of the budget to step back down */
+#define MAX_THROTTLE 1000000 /* usec */
+
+static double cgroup_quota(void)
+{
+    char line[512];
+    char path[600];
+    double quota = 0;
+    FILE *f = fopen("/proc/self/cgroup", "r");
+
+    if (f == NULL)
+        return 0;
+
+    while (quota == 0 && fgets(line, sizeof(line), f))
+    {
+        char *controllers = strchr(line, ':');
+        char *cgpath = controllers ? strchr(controllers + 1, ':') : NULL;
+        FILE *q;
+        long a, b;
+
+        if (cgpath == NULL)
+            continue;
+        *cgpath++ = '\0';
+        cgpath[strcspn(cgpath, "\n")] = '\0';
+        controllers++;
+
+        if (*controllers == '\0')
+        {
+            /* cgroup v2 */
+            char max[32];
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgpath);
+            if ((q = fopen(path, "r")) != NULL)
+            {
+                if (fscanf(q, "%31s %ld", max, &b) == 2 && strcmp(max, "max") != 0 && b > 0)
+                    quota = atol(max) / (double)b;
+                fclose(q);
+            }
+        }
+        else if (strstr(controllers, "cpu") != NULL && strstr(controllers, "cpuset") == NULL)
+        {
+            /* cgroup v1 */
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/%s%s/cpu.cfs_quota_us", controllers, cgpath);
+            if ((q = fopen(path, "r")) != NULL)
+            {
+                if (fscanf(q, "%ld", &a) != 1)
+                    a = -1;
+                fclose(q);
+                snprintf(path, sizeof(path), "/sys/fs/cgroup/%s%s/cpu.cfs_period_us", controllers, cgpath);
+                if (a > 0 && (q = fopen(path, "r")) != NULL)
+                {
+                    if (fscanf(q, "%ld", &b) == 1 && b > 0)
+                        quota = a / (double)b;
+                    fclose(q);
+                }
+            }
+        }
+    }
+
+    fclose(f);
+    return quota;
+}
+
+void init_cpu_budget(int percent)
+{
+    double quota = cgroup_quota();
+
+    budget = percent > 0 ? percent / 100.0 : 0;
+
+    /* keep a margin below the kernel's own throttling */
+    if (quota > 0 && (budget == 0 || quota * 0.9 < budget))
+        budget = quota * 0.9;
+
+    if (budget > 0)
+        info_print("cpu budget: %d%%\n", (int)(budget * 100));
+
+    /* a reload starts over, undegraded */
+    level = BUDGET_NORMAL;
+    extra_usec = 0;
+    win_cycles = 0;
+    clock_gettime(CLOCK_MONOTONIC, &win_wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &win_cpu);
+}
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+/*
+ * Called once per capture cycle, returns the usec to add to the cycle so
+ * that the process CPU usage converges to the budget.
+ */
+long cpu_budget_throttle(void)
+{
+    struct timespec wall, cpu;
+    double dwall, dcpu, usage;
+    long step;
+
+    if (budget == 0)
+        return 0;
+
+    win_cycles++;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    dwall = elapsed(&win_wall, &wall);
+    if (dwall < BUDGET_WINDOW)
+        return extra_usec;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    dcpu = elapsed(&win_cpu, &cpu);
+    usage = dcpu / dwall;
+
+    /* wall time the window should have taken, spread over its cycles */
+    step = (long)((dcpu / budget - dwall) * 1000000.0 / win_cycles);
+
+    if (usage > budget)
+    {
+        if (extra_usec < MAX_THROTTLE)
+        {
+            extra_usec += step;
+            if (extra_usec > MAX_THROTTLE)
+                extra_usec = MAX_THROTTLE;
+        }
+        else if (level < BUDGET_MAX_LEVEL)
+        {
+            level++;
+            info_print("cpu %d%% over budget, degrade level %d\n", (int)(usage * 100), level);
+        }
+    }
+    else if (usage < budget * BUDGET_LOW && level > BUDGET_NORMAL)
+    {
+        level--;
+        info_print("cpu %d%% under budget, degrade level %d\n", (int)(usage * 100), level);
+    }
+    else if (usage < budget)
+    {
+        extra_usec += step;
+        if (extra_usec < 0)
+            extra_usec = 0;
+    }
+
+    win_wall = wall;
+    win_cpu = cpu;
+    win_cycles = 0;
+    return extra_usec;
+}
+
+int cpu_budget_level(void)
+{
+    if (budget == 0)
+        return BUDGET_NORMAL;
+    return level;
+}
@@ -0,0 +1,38 @@
+#ifndef CPUCTL_H
+#define CPUCTL_H
+
+#include <sched.h>
+
+/* Placement and scheduling of one of vncsrv's activities */
+struct thread_sched
+{
+    cpu_set_t cpus;
+    int has_cpus;
+    int policy;    /* SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR */
+    int has_policy;
+    int priority;  /* nice value for OTHER/BATCH, rt priority for FIFO/RR */
+    int has_priority;
+    int is_set;
+};
+
+int parse_cpu_list(const char *value, struct thread_sched *ts);
+int parse_sched_policy(const char *value, struct thread_sched *ts);
+int parse_sched_priority(const char *value, struct thread_sched *ts);
+void apply_thread_sched(const struct thread_sched *ts, const char *name);
+
+/* Degrade levels of the CPU budget governor, each includes the previous */
+enum budget_level
+{
+    BUDGET_NORMAL,
+    BUDGET_ENCODING,    /* clients get the cheapest compression levels */
+    BUDGET_SCAN_HALF,   /* every 2nd line is compared per cycle */
+    BUDGET_SCAN_QUARTER /* every 4th line is compared per cycle */
+};
+
+#define BUDGET_MAX_LEVEL BUDGET_SCAN_QUARTER
+
+void init_cpu_budget(int percent);
+long cpu_budget_throttle(void);
+int cpu_budget_level(void);
+
+#endif //CPUCTL_H
@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+#include "rfb/rfbregion.h"
+
+#include "evloop.h"
+#include "logging.h"
+
+/*
+ * epoll based replacement of rfbProcessEvents(). It owns the listening
+ * sockets, the client sockets, the capture timer and any extra fd, and
+ * drives libvncserver through rfbProcessNewConnection(),
+ * rfbProcessClientMessage() and rfbUpdateClient(). epoll_wait() only gets
+ * a timeout while a client has a deferred update or pointer event, so an
+ * idle server does not wake up at all.
+ */
+
+#define MAX_EVENTS 16
+
+/* how often a client held back by its send queue is looked at again, ms */
+#define OUTPUT_POLL 20
+
+enum watch_kind
+{
+    WATCH_LISTEN,
+    WATCH_CLIENT,
+    WATCH_TIMER,
+    WATCH_FD
+};
+
+struct evwatch
+{
+    int fd;
+    enum watch_kind kind;
+    rfbScreenInfoPtr screen;
+    rfbClientPtr cl;
+    evloop_fd_cb cb;
+    void *arg;
+    int dead;
+    long lag_since;  /* ms, since when its output is held back */
+    int paused;      /* not read while its output is held back */
+    struct evwatch *next;
+};
+
+static int epfd = -1;
+static int timerfd = -1;
+static struct evwatch *watches = NULL;
+static evloop_timer_cb capture_cb = NULL;
+static evloop_client_cb message_cb = NULL;
+static int queue_limit = 0;
+static int lag_limit = 0;
+
+static struct evwatch *add_watch(int fd, enum watch_kind kind)
+{
+    struct epoll_event ev;
+    struct evwatch *w = calloc(1, sizeof(struct evwatch));
+
+    if (w == NULL)
+        return NULL;
+
+    w->fd = fd;
+    w->kind = kind;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        error_print("epoll_ctl add %d failed, %s\n", fd, strerror(errno));
+        free(w);
+        return NULL;
+    }
+
+    w->next = watches;
+    watches = w;
+    return w;
+}
+
+/*
+ * Watches are only marked here, a batch of epoll events may still point to
+ * them. reap_watches() frees them between batches.
+ */
+static void remove_watch(struct evwatch *w)
+{
+    /* closed fds have already left the epoll set */
+    if (w->fd >= 0)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    w->dead = 1;
+}
+
+static void reap_watches(void)
+{
+    struct evwatch **p = &watches;
+
+    while (*p)
+    {
+        struct evwatch *w = *p;
+        if (w->dead)
+        {
+            *p = w->next;
+            free(w);
+        }
+        else
+        {
+            p = &w->next;
+        }
+    }
+}
+
+int init_evloop(void)
+{
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        error_print("epoll_create failed, %s\n", strerror(errno));
+        return 0;
+    }
+
+    if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+    {
+        error_print("timerfd_create failed, %s\n", strerror(errno));
+        return 0;
+    }
+
+    return add_watch(timerfd, WATCH_TIMER) != NULL;
+}
+
+void cleanup_evloop()
+{
+    struct evwatch *w;
+
+    for (w = watches; w; w = w->next)
+        remove_watch(w);
+    reap_watches();
+
+    if (timerfd != -1)
+    {
+        close(timerfd);
+        timerfd = -1;
+    }
+    if (epfd != -1)
+    {
+        close(epfd);
+        epfd = -1;
+    }
+}
+
+void evloop_add_screen(rfbScreenInfoPtr screen)
+{
+    struct evwatch *w;
+
+    if (screen->listenSock >= 0 && (w = add_watch(screen->listenSock, WATCH_LISTEN)) != NULL)
+        w->screen = screen;
+    if (screen->listen6Sock >= 0 && (w = add_watch(screen->listen6Sock, WATCH_LISTEN)) != NULL)
+        w->screen = screen;
+}
+
+/* Picks up clients libvncserver created since the last call */
+void evloop_add_clients(rfbScreenInfoPtr screen)
+{
+    rfbClientPtr cl;
+    struct evwatch *w;
+
+    for (cl = screen->clientHead; cl; cl = cl->next)
+    {
+        if (cl->sock < 0)
+            continue;
+
+        for (w = watches; w; w = w->next)
+        {
+            if (!w->dead && w->kind == WATCH_CLIENT && w->cl == cl)
+                break;
+        }
+
+        if (w == NULL && (w = add_watch(cl->sock, WATCH_CLIENT)) != NULL)
+        {
+            w->screen = screen;
+            w->cl = cl;
+
+            /* room for one more update on top of a full queue */
+            if (queue_limit > 0)
+            {
+                int size = 2 * queue_limit;
+                setsockopt(cl->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            }
+        }
+    }
+}
+
+int evloop_add_fd(int fd, evloop_fd_cb cb, void *arg)
+{
+    struct evwatch *w = add_watch(fd, WATCH_FD);
+
+    if (w == NULL)
+        return 0;
+
+    w->cb = cb;
+    w->arg = arg;
+    return 1;
+}
+
+void evloop_del_fd(int fd)
+{
+    struct evwatch *w;
+
+    for (w = watches; w; w = w->next)
+    {
+        if (!w->dead && w->kind == WATCH_FD && w->fd == fd)
+        {
+            remove_watch(w);
+            return;
+        }
+    }
+}
+
+void evloop_set_capture(evloop_timer_cb cb)
+{
+    capture_cb = cb;
+}
+
+/* cb runs after every message processed from a client */
+void evloop_set_client_hook(evloop_client_cb cb)
+{
+    message_cb = cb;
+}
+
+/*
+ * A client gets no new update while more than queue bytes wait in its
+ * socket, its changes pile up in modifiedRegion and go out merged once it
+ * catches up. Held back for longer than lag ms it is disconnected.
+ * 0 turns either off, an update that does not fit into the socket buffer
+ * waits in any case.
+ */
+void evloop_set_output_limits(int queue, int lag)
+{
+    queue_limit = queue;
+    lag_limit = lag;
+}
+
+/* Makes the capture callback run within usec, an earlier schedule wins */
+void evloop_schedule_capture(long usec)
+{
+    struct itimerspec its;
+
+    if (usec < 1)
+        usec = 1;
+
+    if (timerfd_gettime(timerfd, &its) == 0 &&
+        (its.it_value.tv_sec != 0 || its.it_value.tv_nsec != 0) &&
+        its.it_value.tv_sec * 1000000L + its.it_value.tv_nsec / 1000 <= usec)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = usec / 1000000;
+    its.it_value.tv_nsec = (usec % 1000000) * 1000;
+    timerfd_settime(timerfd, 0, &its, NULL);
+}
+
+static void client_gone(struct evwatch *w)
+{
+    rfbClientPtr cl = w->cl;
+
+    w->fd = -1;
+    remove_watch(w);
+    rfbClientConnectionGone(cl);
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * A client's messages are answered in writes too, so a client whose output
+ * is held back is not read either until it catches up.
+ */
+static void pause_client(struct evwatch *w, int paused)
+{
+    struct epoll_event ev;
+
+    if (w->paused == paused)
+        return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = paused ? 0 : EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, w->fd, &ev) == 0)
+        w->paused = paused;
+}
+
+/* bytes a pending update takes at most: raw pixels, rect headers and some encoding overhead */
+static long update_size(rfbClientPtr cl)
+{
+    sraRegionPtr region;
+    sraRectangleIterator *ri;
+    sraRect r;
+    long size = 4;
+
+    region = sraRgnCreateRgn(cl->modifiedRegion);
+    sraRgnAnd(region, cl->requestedRegion);
+    ri = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(ri, &r))
+    {
+        long raw = (long)(r.x2 - r.x1) * (r.y2 - r.y1) * (cl->format.bitsPerPixel / 8);
+        size += 12 + raw + raw / 16;
+    }
+    sraRgnReleaseIterator(ri);
+    sraRgnDestroy(region);
+    return size;
+}
+
+/*
+ * libvncserver writes a whole update in rfbWriteExact(), waiting in 5 s
+ * selects while the socket is full, and the loop stands still for everyone
+ * meanwhile. An update is only started when it fits into the room left in
+ * the socket buffer, or the queue is empty and the client has taken all it
+ * was sent before.
+ */
+static int update_fits(struct evwatch *w, int queued)
+{
+    int sndbuf;
+    socklen_t len = sizeof(sndbuf);
+
+    if (queued <= 0 || getsockopt(w->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) != 0)
+        return 1;
+    /* the kernel reports twice the size set, half of it is bookkeeping */
+    return update_size(w->cl) <= sndbuf / 2 - queued;
+}
+
+static int output_blocked(struct evwatch *w)
+{
+    int queued;
+    long now;
+
+    if (ioctl(w->fd, SIOCOUTQ, &queued) != 0)
+        queued = 0;
+    if ((queue_limit <= 0 || queued <= queue_limit) && update_fits(w, queued))
+    {
+        w->lag_since = 0;
+        pause_client(w, 0);
+        return 0;
+    }
+
+    now = now_ms();
+    if (w->lag_since == 0)
+    {
+        w->lag_since = now;
+        pause_client(w, 1);
+    }
+    else if (lag_limit > 0 && now - w->lag_since > lag_limit)
+    {
+        info_print("client %s is %ld ms behind with %d bytes queued, disconnecting\n",
+                   w->cl->host, now - w->lag_since, queued);
+        rfbCloseClient(w->cl);
+    }
+    return 1;
+}
+
+/*
+ * rfbUpdateClient() also returns TRUE for changes outside a partial
+ * request, which no deferral will ever send; only a deferral running or
+ * changes the client asked for are waited for.
+ */
+static int update_due(rfbClientPtr cl)
+{
+    sraRegionPtr region;
+    int due;
+
+    if (cl->startDeferring.tv_usec != 0)
+        return 1;
+    region = sraRgnCreateRgn(cl->modifiedRegion);
+    sraRgnAnd(region, cl->requestedRegion);
+    due = !sraRgnEmpty(region);
+    sraRgnDestroy(region);
+    return due;
+}
+
+/*
+ * Sends pending updates and deferred pointer events. Returns the epoll
+ * timeout in ms: -1 unless a client is still deferring something or is
+ * held back by its send queue.
+ */
+static int flush_clients(void)
+{
+    struct evwatch *w;
+    int timeout = -1;
+
+    for (w = watches; w; w = w->next)
+    {
+        rfbClientPtr cl = w->cl;
+
+        if (w->dead || w->kind != WATCH_CLIENT)
+            continue;
+
+        if (cl->sock >= 0 && output_blocked(w))
+        {
+            if (timeout < 0 || OUTPUT_POLL < timeout)
+                timeout = OUTPUT_POLL;
+        }
+        else if (cl->sock >= 0 && ((rfbUpdateClient(cl) && update_due(cl)) || cl->lastPtrX >= 0))
+        {
+            int defer = cl->screen->deferUpdateTime;
+            if (cl->lastPtrX >= 0 && cl->screen->deferPtrUpdateTime < defer)
+                defer = cl->screen->deferPtrUpdateTime;
+            if (defer < 1)
+                defer = 1;
+            if (timeout < 0 || defer < timeout)
+                timeout = defer;
+        }
+
+        if (cl->sock < 0)
+            client_gone(w);
+    }
+
+    return timeout;
+}
+
+void run_evloop(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+
+    for (;;)
+    {
+        int i, n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error_print("epoll_wait failed, %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            struct evwatch *w = events[i].data.ptr;
+            uint64_t expirations;
+
+            if (w->dead)
+                continue;
+
+            switch (w->kind)
+            {
+            case WATCH_LISTEN:
+                rfbProcessNewConnection(w->screen);
+                evloop_add_clients(w->screen);
+                break;
+            case WATCH_CLIENT:
+                /* a closed client is released by flush_clients() */
+                if (w->cl->sock >= 0)
+                {
+                    rfbProcessClientMessage(w->cl);
+                    if (message_cb && w->cl->sock >= 0)
+                        message_cb(w->cl);
+                }
+                break;
+            case WATCH_TIMER:
+                if (read(timerfd, &expirations, sizeof(expirations)) > 0 && capture_cb)
+                    capture_cb();
+                break;
+            case WATCH_FD:
+                w->cb(w->fd, w->arg);
+                break;
+            }
+        }
+
+        timeout = flush_clients();
+        reap_watches();
+    }
+}
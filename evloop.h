@@ -0,0 +1,23 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+typedef void (*evloop_fd_cb)(int fd, void *arg);
+typedef void (*evloop_timer_cb)(void);
+typedef void (*evloop_client_cb)(rfbClientPtr cl);
+
+int init_evloop(void);
+void cleanup_evloop();
+
+void evloop_add_screen(rfbScreenInfoPtr screen);
+void evloop_add_clients(rfbScreenInfoPtr screen);
+int evloop_add_fd(int fd, evloop_fd_cb cb, void *arg);
+void evloop_del_fd(int fd);
+
+void evloop_set_capture(evloop_timer_cb cb);
+void evloop_schedule_capture(long usec);
+void evloop_set_client_hook(evloop_client_cb cb);
+void evloop_set_output_limits(int queue, int lag);
+
+void run_evloop(void);
+
+#endif //EVLOOP_H
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heat.h"
+#include "logging.h"
+
+/*
+ * How often each tile changes, as a sum decayed by 1/16 per capture, in
+ * units of HEAT_UNIT per change. A tile changing on every capture settles
+ * at 16 units, one that changed once falls under COLD_HEAT after about 40
+ * captures.
+ */
+
+#define HEAT_UNIT 256
+#define DECAY_SHIFT 4
+/* changes on about every 4th capture */
+#define HOT_HEAT (4 * HEAT_UNIT)
+#define COLD_HEAT (HEAT_UNIT / 16)
+
+static uint16_t *heat;
+static unsigned char *hot;
+static int heat_w;
+static int heat_h;
+
+int init_heat(int tiles_x, int tiles_y)
+{
+    heat_w = tiles_x;
+    heat_h = tiles_y;
+    heat = calloc(tiles_x * tiles_y, sizeof(uint16_t));
+    hot = calloc(tiles_x * tiles_y, 1);
+    if (heat == NULL || hot == NULL)
+    {
+        error_print("cannot allocate tile heat\n");
+        cleanup_heat();
+        return 0;
+    }
+    return 1;
+}
+
+void cleanup_heat()
+{
+    free(heat);
+    free(hot);
+    heat = NULL;
+    hot = NULL;
+}
+
+/* Decays every tile and adds the changes of one capture */
+void heat_update(const unsigned char *dirty_tiles)
+{
+    int i;
+
+    for (i = 0; i < heat_w * heat_h; i++)
+    {
+        /* rounded up, so a static tile gets to 0 */
+        uint32_t h = heat[i] - ((heat[i] + (1 << DECAY_SHIFT) - 1) >> DECAY_SHIFT);
+
+        if (dirty_tiles[i])
+            h += HEAT_UNIT;
+        heat[i] = h;
+        hot[i] = h >= HOT_HEAT;
+    }
+}
+
+/* 1 for the tiles that change on most captures */
+const unsigned char *heat_hot_tiles(void)
+{
+    return hot;
+}
+
+/* Leaves the tiles that have not changed for a while out of one capture */
+void heat_skip_cold(unsigned char *wanted_tiles)
+{
+    int i;
+
+    for (i = 0; i < heat_w * heat_h; i++)
+    {
+        if (heat[i] < COLD_HEAT)
+            wanted_tiles[i] = 0;
+    }
+}
+
+/*
+ * Writes the map as text, a line per tile row of the framebuffer as it is
+ * before rotation: '.' for a static tile, '0'-'9' for the share of
+ * captures the tile changes on, '9' for nearly all of them.
+ */
+void heat_dump(const char *path)
+{
+    char tmp[280];
+    FILE *f;
+    int tx, ty, nhot = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (f == NULL)
+    {
+        error_print("cannot write %s\n", tmp);
+        return;
+    }
+
+    fprintf(f, "# %dx%d tiles of 16x16\n", heat_w, heat_h);
+    for (ty = 0; ty < heat_h; ty++)
+    {
+        for (tx = 0; tx < heat_w; tx++)
+        {
+            int h = heat[ty * heat_w + tx];
+            int level = h * 10 / (HEAT_UNIT << DECAY_SHIFT);
+
+            nhot += hot[ty * heat_w + tx];
+            fputc(h < COLD_HEAT ? '.' : '0' + (level > 9 ? 9 : level), f);
+        }
+        fputc('\n', f);
+    }
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+    {
+        error_print("cannot write %s\n", path);
+        unlink(tmp);
+        return;
+    }
+    debug_print("%d hot tiles\n", nhot);
+}
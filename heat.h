@@ -0,0 +1,12 @@
+#ifndef HEAT_H
+#define HEAT_H
+
+int init_heat(int tiles_x, int tiles_y);
+void cleanup_heat();
+
+void heat_update(const unsigned char *dirty_tiles);
+const unsigned char *heat_hot_tiles(void);
+void heat_skip_cold(unsigned char *wanted_tiles);
+void heat_dump(const char *path);
+
+#endif //HEAT_H
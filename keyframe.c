@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+#include "rfb/rfbregion.h"
+
+#include "keyframe.h"
+#include "logging.h"
+
+/*
+ * The whole screen kept Hextile encoded, one 16x16 tile at a time, so a new
+ * client gets its first frame as one ready-made write instead of waiting
+ * for the full screen to be encoded. Hextile is used because it is the one
+ * tiled encoding without state: ZRLE, Tight and Zlib carry a zlib stream per
+ * client and their output cannot be shared. Every tile specifies its own
+ * background and foreground, so tiles are re-encoded independently.
+ */
+
+#define KF_TILE 16
+#define KF_MAX_SUBRECTS 255
+
+struct kf_tile
+{
+    unsigned char *data;
+    int len;
+    int cap;
+    int stale;
+};
+
+struct kf_subrect
+{
+    int x;
+    int y;
+    int w;
+    int h;
+    uint32_t pixel;
+};
+
+static struct kf_tile *tiles;
+static int kf_width;
+static int kf_height;
+static int kf_bpp;
+static int kf_tiles_x;
+static int kf_tiles_y;
+static int stale_count;
+
+static char *burst;
+static int burst_cap;
+
+int init_keyframe(int width, int height, int bytespp)
+{
+    if (bytespp != 1 && bytespp != 2 && bytespp != 4)
+    {
+        info_print("keyframe off, %d bytes per pixel is not supported\n", bytespp);
+        return 0;
+    }
+
+    kf_width = width;
+    kf_height = height;
+    kf_bpp = bytespp;
+    kf_tiles_x = (width + KF_TILE - 1) / KF_TILE;
+    kf_tiles_y = (height + KF_TILE - 1) / KF_TILE;
+    tiles = calloc(kf_tiles_x * kf_tiles_y, sizeof(struct kf_tile));
+    if (tiles == NULL)
+    {
+        error_print("cannot allocate keyframe tiles\n");
+        return 0;
+    }
+    keyframe_release();
+    return 1;
+}
+
+void cleanup_keyframe()
+{
+    if (tiles == NULL)
+        return;
+    keyframe_release();
+    free(tiles);
+    tiles = NULL;
+    free(burst);
+    burst = NULL;
+    burst_cap = 0;
+}
+
+/* Drops the encoded tiles, they are rebuilt from the next refresh */
+void keyframe_release(void)
+{
+    int i;
+
+    if (tiles == NULL)
+        return;
+    for (i = 0; i < kf_tiles_x * kf_tiles_y; i++)
+    {
+        free(tiles[i].data);
+        tiles[i].data = NULL;
+        tiles[i].len = 0;
+        tiles[i].cap = 0;
+        tiles[i].stale = 1;
+    }
+    stale_count = kf_tiles_x * kf_tiles_y;
+}
+
+/* Marks the tiles under the pixel rect [x1, x2) x [y1, y2) for re-encoding */
+void keyframe_invalidate(int x1, int y1, int x2, int y2)
+{
+    int tx, ty;
+
+    if (tiles == NULL || x1 >= x2 || y1 >= y2)
+        return;
+
+    for (ty = y1 / KF_TILE; ty <= (y2 - 1) / KF_TILE && ty < kf_tiles_y; ty++)
+    {
+        for (tx = x1 / KF_TILE; tx <= (x2 - 1) / KF_TILE && tx < kf_tiles_x; tx++)
+        {
+            struct kf_tile *t = &tiles[ty * kf_tiles_x + tx];
+            if (!t->stale)
+            {
+                t->stale = 1;
+                stale_count++;
+            }
+        }
+    }
+}
+
+static uint32_t get_pixel(const unsigned char *p)
+{
+    switch (kf_bpp)
+    {
+    case 4:
+        return *(const uint32_t *)p;
+    case 2:
+        return *(const uint16_t *)p;
+    default:
+        return *p;
+    }
+}
+
+static unsigned char *put_pixel(unsigned char *out, uint32_t pixel)
+{
+    switch (kf_bpp)
+    {
+    case 4:
+    {
+        uint32_t v = pixel;
+        memcpy(out, &v, 4);
+        break;
+    }
+    case 2:
+    {
+        uint16_t v = (uint16_t)pixel;
+        memcpy(out, &v, 2);
+        break;
+    }
+    default:
+        *out = (unsigned char)pixel;
+        break;
+    }
+    return out + kf_bpp;
+}
+
+/*
+ * Encodes one w x h tile as a solid, a two colour or a coloured subrect
+ * tile, whichever is smallest, and falls back to raw pixels. Subrects are
+ * runs of a row, grown downwards while the run below is the same.
+ */
+static int encode_tile(const unsigned char *src, int stride, int w, int h, unsigned char *out)
+{
+    static uint32_t px[KF_TILE * KF_TILE];
+    static struct kf_subrect sr[KF_MAX_SUBRECTS];
+    uint32_t colours[8] = { 0 };
+    int counts[8];
+    int ncolours = 0, best;
+    int raw_size = 1 + w * h * kf_bpp;
+    int limit, mono_size, coloured_size;
+    int n = 0, first_open = 0;
+    uint32_t bg, fg = 0;
+    unsigned char *p = out;
+    int x, y, i;
+
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++)
+            px[y * w + x] = get_pixel(src + y * stride + x * kf_bpp);
+
+    /* background is the most common of the first few colours */
+    for (i = 0; i < w * h; i++)
+    {
+        int c;
+        for (c = 0; c < ncolours && colours[c] != px[i]; c++)
+            ;
+        if (c == ncolours)
+        {
+            if (ncolours == 8)
+                break;
+            colours[ncolours] = px[i];
+            counts[ncolours++] = 0;
+        }
+        counts[c]++;
+    }
+    bg = colours[0];
+    for (i = 1, best = counts[0]; i < ncolours; i++)
+    {
+        if (counts[i] > best)
+        {
+            bg = colours[i];
+            best = counts[i];
+        }
+    }
+
+    if (ncolours == 1)
+    {
+        *p++ = rfbHextileBackgroundSpecified;
+        p = put_pixel(p, bg);
+        return p - out;
+    }
+
+    /* a coloured subrect is bpp + 2 bytes, more of them than this do not pay */
+    limit = (raw_size - 2 - kf_bpp) / (kf_bpp + 2);
+    if (limit > KF_MAX_SUBRECTS)
+        limit = KF_MAX_SUBRECTS;
+
+    for (y = 0; y < h; y++)
+    {
+        int open_end = n;
+
+        for (x = 0; x < w;)
+        {
+            uint32_t pixel = px[y * w + x];
+            int x0 = x;
+
+            if (pixel == bg)
+            {
+                x++;
+                continue;
+            }
+            while (x < w && px[y * w + x] == pixel)
+                x++;
+
+            /* subrects ending on the row above can grow */
+            for (i = first_open; i < open_end; i++)
+            {
+                if (sr[i].y + sr[i].h == y && sr[i].x == x0 && sr[i].w == x - x0 && sr[i].pixel == pixel)
+                    break;
+            }
+            if (i < open_end)
+            {
+                sr[i].h++;
+                continue;
+            }
+            if (n == limit)
+                goto raw;
+            sr[n].x = x0;
+            sr[n].y = y;
+            sr[n].w = x - x0;
+            sr[n].h = 1;
+            sr[n].pixel = pixel;
+            n++;
+        }
+
+        /* only subrects that reached this row can grow further */
+        while (first_open < n && sr[first_open].y + sr[first_open].h <= y)
+            first_open++;
+    }
+
+    if (ncolours == 2)
+        fg = colours[0] == bg ? colours[1] : colours[0];
+    mono_size = ncolours == 2 ? 2 + 2 * kf_bpp + 2 * n : raw_size;
+    coloured_size = 2 + kf_bpp + n * (kf_bpp + 2);
+
+    if (mono_size <= coloured_size && mono_size < raw_size)
+    {
+        *p++ = rfbHextileBackgroundSpecified | rfbHextileForegroundSpecified | rfbHextileAnySubrects;
+        p = put_pixel(p, bg);
+        p = put_pixel(p, fg);
+        *p++ = n;
+        for (i = 0; i < n; i++)
+        {
+            *p++ = rfbHextilePackXY(sr[i].x, sr[i].y);
+            *p++ = rfbHextilePackWH(sr[i].w, sr[i].h);
+        }
+        return p - out;
+    }
+    if (coloured_size < raw_size)
+    {
+        *p++ = rfbHextileBackgroundSpecified | rfbHextileAnySubrects | rfbHextileSubrectsColoured;
+        p = put_pixel(p, bg);
+        *p++ = n;
+        for (i = 0; i < n; i++)
+        {
+            p = put_pixel(p, sr[i].pixel);
+            *p++ = rfbHextilePackXY(sr[i].x, sr[i].y);
+            *p++ = rfbHextilePackWH(sr[i].w, sr[i].h);
+        }
+        return p - out;
+    }
+
+raw:
+    *p++ = rfbHextileRaw;
+    for (y = 0; y < h; y++, p += w * kf_bpp)
+        memcpy(p, src + y * stride, w * kf_bpp);
+    return p - out;
+}
+
+/* Re-encodes the stale tiles from the vnc framebuffer */
+void keyframe_refresh(const char *fb)
+{
+    static unsigned char out[1 + KF_TILE * KF_TILE * 4];
+    int stride = kf_width * kf_bpp;
+    int tx, ty;
+
+    if (tiles == NULL || stale_count == 0)
+        return;
+
+    for (ty = 0; ty < kf_tiles_y; ty++)
+    {
+        for (tx = 0; tx < kf_tiles_x; tx++)
+        {
+            struct kf_tile *t = &tiles[ty * kf_tiles_x + tx];
+            int x = tx * KF_TILE;
+            int y = ty * KF_TILE;
+            int w = kf_width - x < KF_TILE ? kf_width - x : KF_TILE;
+            int h = kf_height - y < KF_TILE ? kf_height - y : KF_TILE;
+            int len;
+
+            if (!t->stale)
+                continue;
+
+            len = encode_tile((const unsigned char *)fb + y * stride + x * kf_bpp, stride, w, h, out);
+            if (len > t->cap)
+            {
+                unsigned char *data = realloc(t->data, len);
+                if (data == NULL)
+                {
+                    error_print("cannot allocate keyframe tile\n");
+                    continue;
+                }
+                t->data = data;
+                t->cap = len;
+            }
+            memcpy(t->data, out, len);
+            t->len = len;
+            t->stale = 0;
+            stale_count--;
+        }
+    }
+}
+
+/*
+ * Answers a client's request for the whole screen with the keyframe.
+ * Returns 0 if the client cannot take it and libvncserver has to encode
+ * the update itself: it prefers another encoding, it uses another pixel
+ * format or scaling, or it asked for part of the screen only.
+ */
+int keyframe_send(rfbClientPtr cl, const char *fb)
+{
+    rfbFramebufferUpdateMsg fu;
+    rfbFramebufferUpdateRectHeader rect;
+    sraRegionPtr missing;
+    int covered, size, i;
+    char *p;
+
+    if (tiles == NULL ||
+        cl->preferredEncoding != rfbEncodingHextile ||
+        cl->translateFn != rfbTranslateNone ||
+        cl->scaledScreen != cl->screen ||
+        (cl->useNewFBSize && cl->newFBSizePending))
+        return 0;
+
+    missing = sraRgnCreateRect(0, 0, kf_width, kf_height);
+    sraRgnSubtract(missing, cl->requestedRegion);
+    covered = sraRgnEmpty(missing);
+    sraRgnDestroy(missing);
+    if (!covered)
+        return 0;
+
+    keyframe_refresh(fb);
+    if (stale_count != 0)
+        return 0;
+
+    size = sz_rfbFramebufferUpdateMsg + sz_rfbFramebufferUpdateRectHeader;
+    for (i = 0; i < kf_tiles_x * kf_tiles_y; i++)
+        size += tiles[i].len;
+
+    if (size > burst_cap)
+    {
+        char *b = realloc(burst, size);
+        if (b == NULL)
+        {
+            error_print("cannot allocate keyframe burst\n");
+            return 0;
+        }
+        burst = b;
+        burst_cap = size;
+    }
+
+    fu.type = rfbFramebufferUpdate;
+    fu.pad = 0;
+    fu.nRects = Swap16IfLE(1);
+    rect.r.x = 0;
+    rect.r.y = 0;
+    rect.r.w = Swap16IfLE(kf_width);
+    rect.r.h = Swap16IfLE(kf_height);
+    rect.encoding = Swap32IfLE(rfbEncodingHextile);
+
+    p = burst;
+    memcpy(p, &fu, sz_rfbFramebufferUpdateMsg);
+    p += sz_rfbFramebufferUpdateMsg;
+    memcpy(p, &rect, sz_rfbFramebufferUpdateRectHeader);
+    p += sz_rfbFramebufferUpdateRectHeader;
+    for (i = 0; i < kf_tiles_x * kf_tiles_y; i++)
+    {
+        memcpy(p, tiles[i].data, tiles[i].len);
+        p += tiles[i].len;
+    }
+
+    if (rfbWriteExact(cl, burst, size) < 0)
+    {
+        rfbLogPerror("keyframe_send: write");
+        rfbCloseClient(cl);
+        return 1;
+    }
+    rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, sz_rfbFramebufferUpdateMsg, sz_rfbFramebufferUpdateMsg);
+    rfbStatRecordEncodingSent(cl, rfbEncodingHextile, size - sz_rfbFramebufferUpdateMsg,
+                              sz_rfbFramebufferUpdateRectHeader + kf_width * kf_height * kf_bpp);
+
+    /* what libvncserver would have sent is out now */
+    sraRgnMakeEmpty(cl->requestedRegion);
+    sraRgnMakeEmpty(cl->modifiedRegion);
+    sraRgnMakeEmpty(cl->copyRegion);
+    return 1;
+}
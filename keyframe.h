@@ -0,0 +1,12 @@
+#ifndef KEYFRAME_H
+#define KEYFRAME_H
+
+int init_keyframe(int width, int height, int bytespp);
+void cleanup_keyframe();
+
+void keyframe_invalidate(int x1, int y1, int x2, int y2);
+void keyframe_refresh(const char *fb);
+void keyframe_release(void);
+int keyframe_send(rfbClientPtr cl, const char *fb);
+
+#endif //KEYFRAME_H
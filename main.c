@@ -30,6 +30,8 @@
 
 #include <sys/stat.h>
 #include <sys/sysmacros.h> 
+#include <sys/inotify.h>
+#include <limits.h>
 
 #include <fcntl.h>
 #include <linux/fb.h>
@@ -41,11 +43,25 @@
 
 #include "rfb/rfb.h"
 #include "rfb/keysym.h"
+#include "rfb/rfbregion.h"
 
 #include "touch.h"
 #include "keyboard.h"
 #include "logging.h"
 #include "ini.h"
+#include "rects.h"
+#include "workers.h"
+#include "cpuctl.h"
+#include "evloop.h"
+#include "keyframe.h"
+#include "scaling.h"
+#include "continuous.h"
+#include "palette.h"
+#include "heat.h"
+#include "record.h"
+#include "thumb.h"
+#include "websock.h"
+#include "reverse.h"
 
 #define CLOCKID CLOCK_REALTIME
 #define SIG SIGRTMIN
@@ -58,23 +74,59 @@
 #define BITS_PER_SAMPLE 5
 #define SAMPLES_PER_PIXEL 2
 
-static char fb_device[256] = "/dev/fb0";
 static char touch_device[256] = "/dev/input/ts";
 static char kbd_device[256] = "/dev/input/kbd";
 
-static struct fb_var_screeninfo scrinfo;
-static int fbfd = -1;
 static int kbdfd = -1;
-static unsigned short int *fbmmap = MAP_FAILED;
-static unsigned short int *vncbuf;
-static unsigned short int *fbbuf;
+
+static const char *CONFIG_FILE = "/etc/vncaccess.ini";
 
 static int vnc_port = 5900;
 static int vnc_rotate = 0;
-static rfbScreenInfoPtr server;
-static size_t bytespp;
-static unsigned int bits_per_pixel;
-static unsigned int frame_size;
+static int max_rects = 8;     /* rects per update before merging is forced */
+static int rect_cost = 256;   /* pixels worth resending to save one rect  */
+static int scan_workers = 1;
+static int cpu_budget = 0;    /* percent of one core, 0 - unlimited */
+static int scan_step = 1;     /* compare every scan_step'th line per cycle */
+static int interlace = 1;     /* scan_step when the CPU budget asks for no more */
+static int proc_time = 500000; /* usec between captures */
+static int full_scan = 0;      /* convert every tile without comparing */
+static int keyframe = 1;       /* first full update from a prebuilt Hextile frame */
+static int client_queue = 256; /* KB unsent to a client before its updates are held */
+static int client_lag = 10;    /* seconds a client may stay over client_queue */
+static int tune_jpeg = 1;      /* JPEG only for updates of photo-like content */
+static int photo_quality = 0;  /* JPEG quality 1-100 for photo content, 0 - client's */
+static int palette_colours = 64; /* colour map size for 8 bit clients, 0 - BGR233 */
+static int cold_scan = 4;      /* static tiles are compared every cold_scan'th capture */
+static int input_seen = 0;     /* input since the last capture, compare static tiles too */
+static char heat_file[256] = ""; /* tile change map written here, "" - none */
+static char record_file[256] = ""; /* session recording, "" - none */
+static int record_size = 4096; /* KB of flash the recording and its previous file take */
+static char thumb_file[256] = "";   /* thumbnail JPEG written here, "" - none */
+static char thumb_socket[108] = ""; /* unix socket handing out thumbnails, "" - none */
+static int thumb_width = 160;
+static int thumb_quality = 75;
+static int thumb_interval = 60; /* seconds between thumbnail file writes */
+static int thumbs = 0;          /* thumbnails made, the capture never sleeps for good */
+static int ws_port = 0;         /* port for browsers speaking WebSocket, 0 - none */
+static char http_dir[256] = ""; /* noVNC served from here, "" - none */
+static int http_port = 5800;
+static char reverse_hosts[1024] = ""; /* viewers or repeaters called, "" - none */
+static char reverse_id[64] = "";      /* UltraVNC repeater ID, "" - direct to a viewer */
+static int reverse_retry = 300; /* longest wait in seconds between reverse connection rounds */
+static int reverse = 0;         /* reverse connections made, the shadow buffers are kept */
+static char extra_fb[512] = ""; /* more framebuffers served, device:port[:rotate], "" - none */
+static char overlay_fb[256] = ""; /* overlay plane composited over the panel's display, "" - none */
+static long overlay_key = -1;   /* transparent overlay pixel, -1 - its alpha channel or black */
+
+/* time the HMI gets to redraw after injected input before it is captured */
+#define INPUT_CAPTURE_DELAY 20000
+/* seconds between writes of heat_file */
+#define HEAT_DUMP_INTERVAL 10
+
+/* capture runs on the scan workers, network and input on the main thread */
+static struct thread_sched capture_sched;
+static struct thread_sched network_sched;
 
 int trim5 = 0;
 int matrix = 0;
@@ -101,63 +153,349 @@ static char* passwords[MAX_PASSWORDS] = {NULL};
 static struct auth_info clients_auth_info[MAX_CL];
 static int cl_cnt = 0;
 
+/* Per client state, hangs on cl->clientData */
+struct client_data {
+    int degraded;
+    int tight_compress_level;
+    int zlib_compress_level;
+    int first_request;  /* first update request has been seen */
+    int tuned;          /* quality levels below are in use */
+    int client_tight_quality;
+    int client_turbo_quality;
+    int tuned_tight_quality;
+    int tuned_turbo_quality;
+};
+
 #define UNUSED(x) (void)(x)
 
-static struct varblock_t
+struct varblock_t
 {
-    int min_i;
-    int min_j;
-    int max_i;
-    int max_j;
     int r_offset;
     int g_offset;
     int b_offset;
     int rfb_xres;
     int rfb_maxy;
-} varblock;
+    int rot_origin;
+    int rot_step_x;
+    int rot_step_y;
+};
 
-static void init_fb(void)
+/* Dirty tracking granularity, pixels. Must be a multiple of 8 for 1bpp */
+#define TILE_SIZE 16
+
+/*
+ * A framebuffer exported on a port of its own. The first one is the
+ * panel's display: touch input, keyframes, the palette, heat, recording
+ * and thumbnails belong to it. The others, secondary displays and overlay
+ * planes, are captured and served the same way on the shared event loop
+ * and scan workers.
+ */
+struct display
+{
+    char fb_device[256];
+    int port;
+    int rotate;
+    struct fb_var_screeninfo scrinfo;
+    int fbfd;
+    unsigned char *fbmap;        /* all pages of the virtual framebuffer */
+    size_t map_size;
+    unsigned int map_lines;      /* lines of fbmap */
+    unsigned short int *fbmmap;  /* the page on display */
+    unsigned short int *vncbuf;
+    unsigned short int *fbbuf;
+    size_t vncbuf_size;
+    size_t bytespp;
+    unsigned int bits_per_pixel;
+    unsigned int frame_size;
+    struct varblock_t varblock;
+    int tiles_x;
+    int tiles_y;
+    unsigned char *dirty_tiles;
+    unsigned char *wanted_tiles; /* tiles under a pending client update request */
+    unsigned char *tile_classes; /* enum tile_class of every converted tile */
+    int scan_phase;
+    int flipped;           /* the page on display changed, the next scan is complete */
+    int dormant;           /* no clients, shadow buffers dropped */
+    int capture_waiting;   /* no update request pending, capture stopped */
+    rfbScreenInfoPtr server;
+    /* overlay plane composited over the display, ov_fd -1 - none */
+    int ov_fd;
+    struct fb_var_screeninfo ov_scrinfo;
+    unsigned char *ov_mmap;
+    unsigned char *ov_buf;       /* compare buffer of the overlay */
+    unsigned int ov_bits_per_pixel;
+    unsigned int ov_frame_size;
+    struct varblock_t ov_varblock; /* component offsets of the overlay */
+    long ov_key;                 /* transparent overlay pixel, -1 - alpha channel */
+};
+
+#define MAX_DISPLAYS 4
+
+static struct display displays[MAX_DISPLAYS] = {
+    { .fb_device = "/dev/fb0", .port = 5900, .fbfd = -1, .fbmap = MAP_FAILED, .fbmmap = MAP_FAILED, .ov_fd = -1 }
+};
+static int ndisplays = 1;
+/* the display run_workers() scans */
+static struct display *scanning;
+
+enum tile_class
 {
-    size_t pixels;
+    TILE_FLAT,   /* few colours, plain UI */
+    TILE_DETAIL, /* many colours with sharp edges, antialiased text and lines */
+    TILE_PHOTO   /* many colours in small steps, camera views and gradient fills */
+};
+
+/* Colours a tile may have and still be flat */
+#define FLAT_COLOURS 16
+/* Sum of the three 5 bit component differences that counts as an edge */
+#define SHARP_STEP 12
+
+/* Maps a framebuffer rect [x1, x2) x [y1, y2) to the rotated vnc buffer */
+static void rotate_rect(struct display *d, int *x1, int *y1, int *x2, int *y2)
+{
+    int ox1 = *x1, oy1 = *y1, ox2 = *x2, oy2 = *y2;
 
-    if ((fbfd = open(fb_device, O_RDONLY)) == -1)
+    switch (d->rotate)
     {
-        error_print("cannot open fb device %s\n", fb_device);
-        exit(EXIT_FAILURE);
+    case 90:
+        *x1 = d->scrinfo.yres - oy2;
+        *x2 = d->scrinfo.yres - oy1;
+        *y1 = ox1;
+        *y2 = ox2;
+        break;
+    case 180:
+        *x1 = d->scrinfo.xres - ox2;
+        *x2 = d->scrinfo.xres - ox1;
+        *y1 = d->scrinfo.yres - oy2;
+        *y2 = d->scrinfo.yres - oy1;
+        break;
+    case 270:
+        *x1 = oy1;
+        *x2 = oy2;
+        *y1 = d->scrinfo.xres - ox2;
+        *y2 = d->scrinfo.xres - ox1;
+        break;
     }
+}
 
+/* Maps a vnc buffer rect back to the framebuffer, the inverse of rotate_rect() */
+static void unrotate_rect(struct display *d, int *x1, int *y1, int *x2, int *y2)
+{
+    int ox1 = *x1, oy1 = *y1, ox2 = *x2, oy2 = *y2;
 
-    if (ioctl(fbfd, FBIOGET_VSCREENINFO, &scrinfo) != 0)
+    switch (d->rotate)
     {
-        error_print("ioctl error\n");
-        exit(EXIT_FAILURE);
+    case 90:
+        *x1 = oy1;
+        *x2 = oy2;
+        *y1 = d->scrinfo.yres - ox2;
+        *y2 = d->scrinfo.yres - ox1;
+        break;
+    case 180:
+        *x1 = d->scrinfo.xres - ox2;
+        *x2 = d->scrinfo.xres - ox1;
+        *y1 = d->scrinfo.yres - oy2;
+        *y2 = d->scrinfo.yres - oy1;
+        break;
+    case 270:
+        *x1 = d->scrinfo.xres - oy2;
+        *x2 = d->scrinfo.xres - oy1;
+        *y1 = ox1;
+        *y2 = ox2;
+        break;
+    }
+}
+
+/* Maps a client pointer position back to framebuffer coordinates */
+static void unrotate_point(struct display *d, int *x, int *y)
+{
+    int ox = *x, oy = *y;
+
+    switch (d->rotate)
+    {
+    case 90:
+        *x = oy;
+        *y = d->scrinfo.yres - 1 - ox;
+        break;
+    case 180:
+        *x = d->scrinfo.xres - 1 - ox;
+        *y = d->scrinfo.yres - 1 - oy;
+        break;
+    case 270:
+        *x = d->scrinfo.xres - 1 - oy;
+        *y = ox;
+        break;
     }
+}
+
+/*
+ * Rotation is an affine map of framebuffer (x, y) to a vncbuf pixel index:
+ * rot_origin + x * rot_step_x + y * rot_step_y
+ */
+static void init_rotation(struct display *d)
+{
+    int xres = d->scrinfo.xres, yres = d->scrinfo.yres;
+
+    switch (d->rotate)
+    {
+    case 0:
+        d->varblock.rot_origin = 0;
+        d->varblock.rot_step_x = 1;
+        d->varblock.rot_step_y = xres;
+        break;
+    case 90:
+        d->varblock.rot_origin = yres - 1;
+        d->varblock.rot_step_x = yres;
+        d->varblock.rot_step_y = -1;
+        break;
+    case 180:
+        d->varblock.rot_origin = xres * yres - 1;
+        d->varblock.rot_step_x = -1;
+        d->varblock.rot_step_y = -xres;
+        break;
+    case 270:
+        d->varblock.rot_origin = (xres - 1) * yres;
+        d->varblock.rot_step_x = -yres;
+        d->varblock.rot_step_y = 1;
+        break;
+    }
+}
+
+/*
+ * Captures read the page the panel shows. A runtime drawing double
+ * buffered with FBIOPAN_DISPLAY flips yoffset between pages; the page
+ * drawn into is never read, so there is no tearing.
+ */
+static void show_page(struct display *d, unsigned int yoffset)
+{
+    size_t line_bytes = d->scrinfo.xres * d->bits_per_pixel / 8;
+
+    if (yoffset + d->scrinfo.yres > d->map_lines)
+        yoffset = 0;
+    d->fbmmap = (unsigned short int *)(d->fbmap + yoffset * line_bytes);
+}
 
-    pixels = scrinfo.xres * scrinfo.yres;
-    bytespp = scrinfo.bits_per_pixel / 8;
-    bits_per_pixel = scrinfo.bits_per_pixel;
-    frame_size = pixels * bits_per_pixel / 8;
-    fbmmap = mmap(NULL, frame_size, PROT_READ, MAP_SHARED, fbfd, 0);
+/* Maps all pages of the mode in d->scrinfo */
+static void map_fb(struct display *d)
+{
+    size_t pixels = d->scrinfo.xres * d->scrinfo.yres;
+
+    d->bytespp = d->scrinfo.bits_per_pixel / 8;
+    d->bits_per_pixel = d->scrinfo.bits_per_pixel;
+    d->frame_size = pixels * d->bits_per_pixel / 8;
+
+    /* pages are whole frames one after the other only without xres panning */
+    d->map_lines = d->scrinfo.yres;
+    if (d->scrinfo.xres_virtual == d->scrinfo.xres && d->scrinfo.yres_virtual > d->scrinfo.yres)
+        d->map_lines = d->scrinfo.yres_virtual;
+    d->map_size = (size_t)d->scrinfo.xres * d->map_lines * d->bits_per_pixel / 8;
+    d->fbmap = mmap(NULL, d->map_size, PROT_READ, MAP_SHARED, d->fbfd, 0);
+    if (d->fbmap == MAP_FAILED && d->map_lines > d->scrinfo.yres)
+    {
+        /* the driver's memory holds fewer pages than the mode says */
+        d->map_lines = d->scrinfo.yres;
+        d->map_size = d->frame_size;
+        d->fbmap = mmap(NULL, d->map_size, PROT_READ, MAP_SHARED, d->fbfd, 0);
+    }
 
-    if (fbmmap == MAP_FAILED)
+    if (d->fbmap == MAP_FAILED)
     {
         error_print("mmap failed\n");
         exit(EXIT_FAILURE);
     }
+    show_page(d, d->scrinfo.yoffset);
+}
+
+static void init_fb(struct display *d)
+{
+    if ((d->fbfd = open(d->fb_device, O_RDONLY)) == -1)
+    {
+        error_print("cannot open fb device %s\n", d->fb_device);
+        exit(EXIT_FAILURE);
+    }
+
+
+    if (ioctl(d->fbfd, FBIOGET_VSCREENINFO, &d->scrinfo) != 0)
+    {
+        error_print("ioctl error\n");
+        exit(EXIT_FAILURE);
+    }
+    map_fb(d);
 }
 
-static void cleanup_fb(void)
+static void cleanup_fb(struct display *d)
 {
-    if (fbfd != -1)
+    if (d->fbfd != -1)
+    {
+        close(d->fbfd);
+        d->fbfd = -1;
+    }
+    if (d->ov_fd != -1)
+    {
+        close(d->ov_fd);
+        d->ov_fd = -1;
+    }
+}
+
+/*
+ * The panel's display comes from vnc_rotate and vnc_port, the others from
+ * extra_fb: device:port[:rotate] separated by commas or blanks.
+ */
+static void init_displays(void)
+{
+    char buf[sizeof(extra_fb)];
+    char *tok, *save;
+    int i;
+
+    displays[0].port = vnc_port;
+    displays[0].rotate = vnc_rotate;
+
+    snprintf(buf, sizeof(buf), "%s", extra_fb);
+    for (tok = strtok_r(buf, ", \t", &save); tok != NULL; tok = strtok_r(NULL, ", \t", &save))
     {
-        close(fbfd);
-        fbfd = -1;
+        struct display *d = &displays[ndisplays];
+        char *port = strchr(tok, ':');
+        char *rotate;
+
+        if (ndisplays == MAX_DISPLAYS)
+        {
+            error_print("more than %d displays, %s ignored\n", MAX_DISPLAYS, tok);
+            continue;
+        }
+        if (port == NULL)
+        {
+            error_print("no port for %s\n", tok);
+            continue;
+        }
+        *port++ = '\0';
+        rotate = strchr(port, ':');
+        if (rotate != NULL)
+            *rotate++ = '\0';
+
+        /* a second server on a port in use would not listen, only log it */
+        for (i = 0; i < ndisplays && displays[i].port != atoi(port); i++)
+            ;
+        if (i < ndisplays || atoi(port) <= 0)
+        {
+            error_print("%s ignored, port %s is invalid or another display has it\n", tok, port);
+            continue;
+        }
+
+        memset(d, 0, sizeof(*d));
+        snprintf(d->fb_device, sizeof(d->fb_device), "%s", tok);
+        d->port = atoi(port);
+        d->rotate = rotate != NULL ? atoi(rotate) : 0;
+        d->fbfd = -1;
+        d->fbmap = MAP_FAILED;
+        d->fbmmap = MAP_FAILED;
+        d->ov_fd = -1;
+        ndisplays++;
     }
 }
 
 static int cnt = 0;
 
-static void update_screen(void);
+static void update_screen(struct display *d);
 
 int wait_time(int time_to_wait) // ms
 {
@@ -208,6 +546,13 @@ static rfbKeySym curr_key_proc = 0xFFFFFFFF;
 static int curr_key_stat_proc = -1;
 static int pass_cnt = 0;
 
+/* Captures soon after injected input, the static tiles included */
+static void input_capture(void)
+{
+    input_seen = 1;
+    evloop_schedule_capture(INPUT_CAPTURE_DELAY);
+}
+
 static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 {
     // info_print("raw %d %d\n", down, key);
@@ -215,7 +560,6 @@ static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 
     if (!scancode ||( !(curr_key_proc == -1) && (key != curr_key_proc))) {
         // info_print("pass %d %d %d\n", curr_key_proc, key, down);
-        rfbProcessEvents(server, 1000000);
         return;
     }
 
@@ -239,12 +583,7 @@ static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
         ++pass_cnt;
         // info_print("pass fast keys %d %d %d  pass_cnt %d\n", curr_key_proc, key, down, pass_cnt);
         if ((pass_cnt % 10) == 0) {
-            rfbProcessEvents(server, 1000);
-            update_screen();
-            rfbProcessEvents(server, 1000);
-
-        } else {
-            rfbProcessEvents(server, 50000);
+            input_capture();
         }
         return;
     } else {
@@ -281,7 +620,7 @@ static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
         
         if (allow_sysmenu == 2) {
             if (trim5 == 1) {
-                trim5SysMenu(&scrinfo);
+                trim5SysMenu(&displays[0].scrinfo);
                 return;
             } else {
                 injectKeyEventSeq(down, matrix);
@@ -296,20 +635,20 @@ static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
         curr_key_stat_proc = down;
         if (down == 0) curr_key_proc = -1;
         injectKeyEvent(scancode, down);
+        if (cl->screen == displays[0].server)
+            record_key(cl, down, key);
 
         // info_print("inject %d %d\n", down, scancode);
-        rfbProcessEvents(server, 1000);
-        update_screen();
-        rfbProcessEvents(server, 1000);
+        input_capture();
     } else if (trim5 == 1) {
         if (key == 0xFFbe) {//F1??
-            trim5Info(&scrinfo);
+            trim5Info(&displays[0].scrinfo);
         } else if (key == 0xFFbf) { // F2
-            trim5Home(&scrinfo);
+            trim5Home(&displays[0].scrinfo);
         } else if (key == 0xFFC2) { // F5
-            trim5Start(&scrinfo);
+            trim5Start(&displays[0].scrinfo);
         } else if (key == 0xFFC4) { // F7
-            trim5Menu(&scrinfo);
+            trim5Menu(&displays[0].scrinfo);
         }
     }
     ++cnt;
@@ -318,7 +657,10 @@ static void keyevent(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 
 static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
 {
-    UNUSED(cl);
+    struct display *d = &displays[0];
+    int vnc_x = x, vnc_y = y;
+
+    unrotate_point(d, &x, &y);
     if (trim5 == 1) {
         if (x > 799 || y > 599 || x < 0 || y < 0) {
             // info_print("ptrevent out ouf range %d %d\n", x, y);
@@ -340,24 +682,25 @@ static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
 
 //    printf("ptrevent %d(%d) %d(%d) %d %d \n", x, pressed_x, y, pressed_y, buttonMask, pressed);
     if (buttonMask == 0 && ! (pressed == 1)) {   
-        rfbProcessEvents(server, 25000);
         return;
     } 
+    if (cl->screen == displays[0].server)
+        record_pointer(cl, buttonMask, vnc_x, vnc_y);
 
     if (buttonMask & 1)
     {
         if (pressed == 1)
         {
-            injectTouchEvent(MouseDrag, x, y, &scrinfo);
+            injectTouchEvent(MouseDrag, x, y, &d->scrinfo);
 
-            rfbProcessEvents(server, 20000);
+            input_capture();
 
         } else {
 
             pressed = 1;
             pressed_x = x;
             pressed_y = y;
-            injectTouchEvent(MousePress, x, y, &scrinfo);
+            injectTouchEvent(MousePress, x, y, &d->scrinfo);
         }
     }
     if (buttonMask == 0)
@@ -369,8 +712,8 @@ static void ptrevent(int buttonMask, int x, int y, rfbClientPtr cl)
             pressed_y = y;
 
             // info_print("do MouseRelease \n");
-            injectTouchEvent(MouseRelease, x, y, &scrinfo);
-            rfbProcessEvents(server, 1000);
+            injectTouchEvent(MouseRelease, x, y, &d->scrinfo);
+            input_capture();
         }
     }
 }
@@ -421,6 +764,15 @@ void clientGoneF(struct _rfbClientRec* cl) {
         }
     }
 
+    /* the recording is of the first display only */
+    if (cl->screen == displays[0].server)
+        record_client(cl, 0);
+    reverse_client_gone(cl);
+    free(cl->clientData);
+    cl->clientData = NULL;
+
+    /* a waiting capture has to notice the last client is gone */
+    evloop_schedule_capture(0);
 }
 enum rfbNewClientAction newClientHookF(struct _rfbClientRec* cl) {
     // info_print("newClientHookF %X\n", cl);
@@ -433,6 +785,12 @@ enum rfbNewClientAction newClientHookF(struct _rfbClientRec* cl) {
     cl->enableServerIdentity = FALSE;
     cl->compStreamInitedLZO = FALSE;
     cl->zlibCompressLevel = 0;
+    cl->clientData = calloc(1, sizeof(struct client_data));
+    if (cl->screen == displays[0].server)
+        record_client(cl, 1);
+
+    /* capture is idle while nobody is connected */
+    evloop_schedule_capture(0);
 
     return RFB_CLIENT_ACCEPT;
 }
@@ -441,67 +799,276 @@ enum rfbNewClientAction newClientHookF(struct _rfbClientRec* cl) {
 
 
 
-static void init_fb_server(int argc, char **argv, rfbBool enable_touch)
+/*
+ * Tight sends every subrect with too many colours for a palette as JPEG
+ * once the client asked for a quality level, antialiased UI text too.
+ * Before each update of such a client JPEG is left on only if most of the
+ * tiles going out are photo-like, then with photo_quality if that is set.
+ */
+static void tune_quality(rfbClientPtr cl)
 {
-    //todo: read and fill auth dta here from file
-    int i;
-    for (i = 0; i < MAX_CL; ++i) {
-        clients_auth_info[i].cl = NULL;
-        clients_auth_info[i].rights = 0;
+    struct client_data *cd = cl->clientData;
+    struct display *d = cl->screen->screenData;
+    sraRegionPtr region;
+    sraRectangleIterator *ri;
+    sraRect r;
+    int photo = 0, other = 0;
+
+    if (!tune_jpeg || cd == NULL || cl->preferredEncoding != rfbEncodingTight)
+        return;
+
+    /* the client may have sent SetEncodings since */
+    if (!cd->tuned || cl->tightQualityLevel != cd->tuned_tight_quality ||
+        cl->turboQualityLevel != cd->tuned_turbo_quality) {
+        cd->client_tight_quality = cl->tightQualityLevel;
+        cd->client_turbo_quality = cl->turboQualityLevel;
+    }
+    if (cd->client_tight_quality == -1 && cd->client_turbo_quality == -1) {
+        cd->tuned = 0;
+        return;
+    }
+
+    region = sraRgnCreateRgn(cl->modifiedRegion);
+    sraRgnAnd(region, cl->requestedRegion);
+    ri = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(ri, &r))
+    {
+        int tx, ty;
+
+        unrotate_rect(d, &r.x1, &r.y1, &r.x2, &r.y2);
+        if (r.x2 > (int)d->scrinfo.xres)
+            r.x2 = d->scrinfo.xres;
+        if (r.y2 > (int)d->scrinfo.yres)
+            r.y2 = d->scrinfo.yres;
+
+        for (ty = r.y1 / TILE_SIZE; ty * TILE_SIZE < r.y2; ty++)
+        {
+            for (tx = r.x1 / TILE_SIZE; tx * TILE_SIZE < r.x2; tx++)
+            {
+                if (d->tile_classes[ty * d->tiles_x + tx] == TILE_PHOTO)
+                    photo++;
+                else
+                    other++;
+            }
+        }
+    }
+    sraRgnReleaseIterator(ri);
+    sraRgnDestroy(region);
+
+    if (photo > other) {
+        cl->tightQualityLevel = cd->client_tight_quality;
+        cl->turboQualityLevel = photo_quality > 0 ? photo_quality : cd->client_turbo_quality;
+    } else {
+        cl->tightQualityLevel = -1;
+        cl->turboQualityLevel = -1;
+    }
+    cd->tuned_tight_quality = cl->tightQualityLevel;
+    cd->tuned_turbo_quality = cl->turboQualityLevel;
+    cd->tuned = 1;
+}
+
+/* Shadow buffers are anonymous mappings, so they can be dropped while dormant */
+static void *alloc_shadow(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+    {
+        error_print("cannot allocate %zu bytes, %s\n", size, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ * Maps an overlay plane of the display's size. It is composited where it
+ * is not transparent: where its alpha channel says so, or where it is not
+ * the key colour if key is set, black if it has no alpha either.
+ * Returns 0 if the plane cannot be used.
+ */
+static int init_overlay(struct display *d, const char *device, long key)
+{
+    struct fb_var_screeninfo *ov = &d->ov_scrinfo;
+
+    if ((d->ov_fd = open(device, O_RDONLY)) == -1)
+    {
+        error_print("cannot open overlay %s\n", device);
+        return 0;
+    }
+    if (ioctl(d->ov_fd, FBIOGET_VSCREENINFO, ov) != 0 ||
+        ov->xres != d->scrinfo.xres || ov->yres != d->scrinfo.yres ||
+        (ov->bits_per_pixel != 16 && ov->bits_per_pixel != 32) ||
+        (d->bits_per_pixel != 16 && d->bits_per_pixel != 32))
+    {
+        error_print("overlay %s does not fit %s, not composited\n", device, d->fb_device);
+        close(d->ov_fd);
+        d->ov_fd = -1;
+        return 0;
+    }
+
+    d->ov_bits_per_pixel = ov->bits_per_pixel;
+    d->ov_frame_size = ov->xres * ov->yres * ov->bits_per_pixel / 8;
+    d->ov_mmap = mmap(NULL, d->ov_frame_size, PROT_READ, MAP_SHARED, d->ov_fd, 0);
+    if (d->ov_mmap == MAP_FAILED)
+    {
+        error_print("mmap of overlay %s failed\n", device);
+        close(d->ov_fd);
+        d->ov_fd = -1;
+        return 0;
     }
+    d->ov_buf = alloc_shadow(d->ov_frame_size);
 
+    d->ov_varblock.r_offset = ov->red.offset + ov->red.length - BITS_PER_SAMPLE;
+    d->ov_varblock.g_offset = ov->green.offset + ov->green.length - BITS_PER_SAMPLE;
+    d->ov_varblock.b_offset = ov->blue.offset + ov->blue.length - BITS_PER_SAMPLE;
+    d->ov_key = key >= 0 || ov->transp.length > 0 ? key : 0;
+    info_print("overlay %s composited, %s\n", device, d->ov_key >= 0 ? "colour key" : "alpha");
+    return 1;
+}
+
+static void apply_capture_sched(void)
+{
+    apply_thread_sched(&capture_sched, "capture");
+}
+
+/* Bytes of a vncbuf pixel, 1 bpp is served as 8 */
+static int rfb_bytespp(struct display *d)
+{
+    return d->bits_per_pixel == 1 ? 1 : d->bytespp;
+}
+
+/* Everything sized by the framebuffer mode */
+static void init_shadows(struct display *d)
+{
+    int rframe_size = d->bits_per_pixel == 1 ? d->frame_size * 8 : d->frame_size;
+
+    d->vncbuf_size = rframe_size;
+    /* anonymous pages come zeroed, untouched they cost no RAM until a client comes */
+    d->vncbuf = alloc_shadow(d->vncbuf_size);
+    if (d->bits_per_pixel == 1)
+        memset(d->vncbuf, 0xFF, rframe_size);
+
+    d->fbbuf = alloc_shadow(d->frame_size);
+
+    d->tiles_x = (d->scrinfo.xres + TILE_SIZE - 1) / TILE_SIZE;
+    d->tiles_y = (d->scrinfo.yres + TILE_SIZE - 1) / TILE_SIZE;
+    d->dirty_tiles = calloc(d->tiles_x * d->tiles_y, 1);
+    assert(d->dirty_tiles != NULL);
+    d->wanted_tiles = calloc(d->tiles_x * d->tiles_y, 1);
+    assert(d->wanted_tiles != NULL);
+    d->tile_classes = calloc(d->tiles_x * d->tiles_y, 1);
+    assert(d->tile_classes != NULL);
+    if (!init_rects(d->tiles_x, d->tiles_y))
+        exit(EXIT_FAILURE);
+
+    if (d->rotate == 90 || d->rotate == 270) {
+        d->varblock.rfb_xres = d->scrinfo.yres;
+        d->varblock.rfb_maxy = d->scrinfo.xres - 1;
+    } else {
+        d->varblock.rfb_xres = d->scrinfo.xres;
+        d->varblock.rfb_maxy = d->scrinfo.yres - 1;
+    }
+    init_rotation(d);
+
+    d->varblock.r_offset = d->scrinfo.red.offset + d->scrinfo.red.length - BITS_PER_SAMPLE;
+    d->varblock.g_offset = d->scrinfo.green.offset + d->scrinfo.green.length - BITS_PER_SAMPLE;
+    d->varblock.b_offset = d->scrinfo.blue.offset + d->scrinfo.blue.length - BITS_PER_SAMPLE;
+}
 
-    int rbytespp = bits_per_pixel == 1 ? 1 : bytespp;
-    int rframe_size = bits_per_pixel == 1 ? frame_size * 8 : frame_size;
+/* The vncbuf is the server's framebuffer, it goes when the server has another */
+static void free_shadows(struct display *d)
+{
+    munmap(d->fbbuf, d->frame_size);
+    free(d->dirty_tiles);
+    free(d->wanted_tiles);
+    free(d->tile_classes);
+}
 
-    vncbuf = malloc(rframe_size);
-    assert(vncbuf != NULL);
-    memset(vncbuf, bits_per_pixel == 1 ? 0xFF : 0x00, rframe_size);
+/* Shadow buffers, tiles and the RFB server of one display */
+static void init_display(struct display *d, int argc, char **argv, rfbBool enable_touch)
+{
+    int primary = d == &displays[0];
 
-    fbbuf = calloc(frame_size, 1);
-    assert(fbbuf != NULL);
+    if (d->rotate != 0 && d->rotate != 90 && d->rotate != 180 && d->rotate != 270) {
+        error_print("rotation %d of %s is invalid, using 0\n", d->rotate, d->fb_device);
+        d->rotate = 0;
+    }
+    init_shadows(d);
 
-    server = rfbGetScreen(&argc, argv, scrinfo.xres, scrinfo.yres, BITS_PER_SAMPLE, SAMPLES_PER_PIXEL, rbytespp);
-    assert(server != NULL);
+    d->server = rfbGetScreen(&argc, argv, d->varblock.rfb_xres, d->varblock.rfb_maxy + 1, BITS_PER_SAMPLE, SAMPLES_PER_PIXEL, rfb_bytespp(d));
+    assert(d->server != NULL);
 
 //    //passwords
     
-    server->authPasswdData = (void*)passwords;
-    server->passwordCheck=myCheckPasswordByList;
-
-    server->desktopName = "Mikhailov's vncsrv";
-    server->frameBuffer = (char *)vncbuf;
-    server->alwaysShared = TRUE;
-    server->httpDir = NULL;
-    server->port = vnc_port;
-    server->newClientHook = newClientHookF;
-    server->kbdAddEvent = keyevent;
+    d->server->authPasswdData = (void*)passwords;
+    d->server->passwordCheck=myCheckPasswordByList;
+
+    d->server->desktopName = "Mikhailov's vncsrv";
+    d->server->frameBuffer = (char *)d->vncbuf;
+    d->server->alwaysShared = TRUE;
+    d->server->httpDir = NULL;
+    d->server->port = d->port;
+    d->server->screenData = d;
+    d->server->newClientHook = newClientHookF;
+    d->server->displayHook = tune_quality;
+    d->server->kbdAddEvent = keyevent;
     //server->ptrAddEvent = ptrevent;
 
-    if (enable_touch)
+    /* the touch screen and the web client belong to the panel's display */
+    if (primary)
     {
-        server->ptrAddEvent = ptrevent;
+        websock_http(d->server, http_dir, http_port);
+        if (enable_touch)
+            d->server->ptrAddEvent = ptrevent;
     }
 
-    rfbInitServer(server);
+    rfbInitServer(d->server);
+    init_continuous(d->server);
+
+    rfbMarkRectAsModified(d->server, 0, 0, d->server->width, d->server->height);
+}
 
+static void detect_trim5(struct display *d)
+{
     //debug_print("scrinfo.xres %d, scrinfo.yres %d\n",scrinfo.xres, scrinfo.yres);
-    if (scrinfo.xres == 800 && scrinfo.yres == 480) {
+    if (d->scrinfo.xres == 800 && d->scrinfo.yres == 480) {
         trim5 = 1;
         info_print("trim5 detected\n");
     } else {
         info_print("NO trim5 detected\n");
         trim5 = 0;
     }
-    
+}
+
+static void init_fb_server(int argc, char **argv, rfbBool enable_touch)
+{
+    struct display *d = &displays[0];
+    int max_tiles_y = 0;
+
+    //todo: read and fill auth dta here from file
+    int i;
+    for (i = 0; i < MAX_CL; ++i) {
+        clients_auth_info[i].cl = NULL;
+        clients_auth_info[i].rights = 0;
+    }
+
+    for (i = 0; i < ndisplays; i++) {
+        init_display(&displays[i], argc, argv, enable_touch);
+        if (displays[i].tiles_y > max_tiles_y)
+            max_tiles_y = displays[i].tiles_y;
+    }
 
-    rfbMarkRectAsModified(server, 0, 0, scrinfo.xres, scrinfo.yres);
+    /* the workers are shared, a band is at least a tile row of the tallest display */
+    init_workers(scan_workers < max_tiles_y ? scan_workers : max_tiles_y, capture_sched.is_set, apply_capture_sched);
 
-    varblock.r_offset = scrinfo.red.offset + scrinfo.red.length - BITS_PER_SAMPLE;
-    varblock.g_offset = scrinfo.green.offset + scrinfo.green.length - BITS_PER_SAMPLE;
-    varblock.b_offset = scrinfo.blue.offset + scrinfo.blue.length - BITS_PER_SAMPLE;
-    varblock.rfb_xres = scrinfo.yres;
-    varblock.rfb_maxy = scrinfo.xres - 1;
+    if (!init_heat(d->tiles_x, d->tiles_y))
+        exit(EXIT_FAILURE);
+    if (keyframe && !init_keyframe(d->server->width, d->server->height, rfb_bytespp(d)))
+        keyframe = 0;
+    if (palette_colours > 0 && !init_palette(d->server, palette_colours))
+        palette_colours = 0;
+    init_record(d->server, record_file, record_size);
+    detect_trim5(d);
 }
 
 // sec
@@ -524,287 +1091,466 @@ int timeToLogFPS()
 #define PIXEL_FB_TO_RFB(p, r_offset, g_offset, b_offset) \
     ((p >> r_offset) & COLOR_MASK) | (((p >> g_offset) & COLOR_MASK) << BITS_PER_SAMPLE) | (((p >> b_offset) & COLOR_MASK) << (2 * BITS_PER_SAMPLE))
 
-static void update_screen(void)
-{
 /*
-if (pass_update_screen == 0 && !timeToLogFPS()) {
-   	info_print("pass_update_screen");
-	pass_update_screen = 1;
-	return;
-   }
-*/
-   static int frames = 0;
-   frames++;
-   if (0 && timeToLogFPS())
-   {
-       double fps = frames / LOG_TIME;
-       info_print("  fps: %f\n", fps);
-       frames = 0;
-   }
-
-    varblock.min_i = varblock.min_j = 9999;
-    varblock.max_i = varblock.max_j = -1;
-
-    if (vnc_rotate == 0 && bits_per_pixel == 24)
+ * Copies one dirty tile into the compare buffer and converts it from there
+ * into vncbuf. The tile is small enough that both the source lines and the
+ * transposed destination lines of a 90/270 rotation stay in cache.
+ */
+static void convert_tile(struct display *d, int tx, int ty)
+{
+    int x0 = tx * TILE_SIZE;
+    int y0 = ty * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE;
+    int y1 = y0 + TILE_SIZE;
+    int sx = d->varblock.rot_step_x;
+    int line_bytes = d->scrinfo.xres * d->bits_per_pixel / 8;
+    int y;
+
+    if (x1 > (int)d->scrinfo.xres)
+        x1 = d->scrinfo.xres;
+    if (y1 > (int)d->scrinfo.yres)
+        y1 = d->scrinfo.yres;
+
+    for (y = y0; y < y1; y++)
     {
-        uint8_t *f = (uint8_t *)fbmmap; /* -> framebuffer         */
-        uint8_t *c = (uint8_t *)fbbuf;  /* -> compare framebuffer */
-        uint8_t *r = (uint8_t *)vncbuf; /* -> remote framebuffer  */
+        int offset = y * line_bytes + x0 * d->bits_per_pixel / 8;
+        int v = d->varblock.rot_origin + x0 * sx + y * d->varblock.rot_step_y;
+        uint8_t *c = (uint8_t *)d->fbbuf + offset;
+        int x;
 
-        if (memcmp(fbmmap, fbbuf, frame_size) != 0)
+        memcpy(c, (uint8_t *)d->fbmmap + offset, (x1 - x0) * d->bits_per_pixel / 8);
+
+        switch (d->bits_per_pixel)
+        {
+        case 32:
         {
-            int y;
-            for (y = 0; y < (int)scrinfo.yres; y++)
+            uint32_t *p = (uint32_t *)c;
+            uint32_t *r = (uint32_t *)d->vncbuf;
+            for (x = x0; x < x1; x++, v += sx)
             {
-                int x;
-                for (x = 0; x < (int)scrinfo.xres; x++)
-                {
-                    uint32_t pixel = *(uint32_t *)f & 0x00FFFFFF;
-                    uint32_t comp = *(uint32_t *)c & 0x00FFFFFF;
-
-                    if (pixel != comp)
-                    {
-                        *(c + 0) = *(f + 0);
-                        *(c + 1) = *(f + 1);
-                        *(c + 2) = *(f + 2);
-                        uint32_t rem = PIXEL_FB_TO_RFB(pixel,
-                                                       varblock.r_offset, varblock.g_offset, varblock.b_offset);
-                        *(r + 0) = (uint8_t)((rem >> 0) & 0xFF);
-                        *(r + 1) = (uint8_t)((rem >> 8) & 0xFF);
-                        *(r + 2) = (uint8_t)((rem >> 16) & 0xFF);
-
-                        if (x < varblock.min_i)
-                            varblock.min_i = x;
-                        else if (x > varblock.max_i)
-                            varblock.max_i = x;
-
-                        if (y > varblock.max_j)
-                            varblock.max_j = y;
-                        else if (y < varblock.min_j)
-                            varblock.min_j = y;
-                    }
-
-                    f += bytespp;
-                    c += bytespp;
-                    r += bytespp;
-                }
+                uint32_t pixel = *p++;
+                r[v] = PIXEL_FB_TO_RFB(pixel, d->varblock.r_offset, d->varblock.g_offset, d->varblock.b_offset);
+            }
+            break;
+        }
+        case 24:
+        {
+            uint8_t *r = (uint8_t *)d->vncbuf;
+            for (x = x0; x < x1; x++, v += sx, c += 3)
+            {
+                uint32_t pixel = c[0] | (c[1] << 8) | (c[2] << 16);
+                uint32_t rem = PIXEL_FB_TO_RFB(pixel,
+                                               d->varblock.r_offset, d->varblock.g_offset, d->varblock.b_offset);
+                r[v * 3 + 0] = (uint8_t)((rem >> 0) & 0xFF);
+                r[v * 3 + 1] = (uint8_t)((rem >> 8) & 0xFF);
+                r[v * 3 + 2] = (uint8_t)((rem >> 16) & 0xFF);
             }
+            break;
+        }
+        case 16:
+        {
+            uint16_t *p = (uint16_t *)c;
+            uint16_t *r = (uint16_t *)d->vncbuf;
+            for (x = x0; x < x1; x++, v += sx)
+            {
+                uint32_t pixel = *p++;
+                r[v] = PIXEL_FB_TO_RFB(pixel, d->varblock.r_offset, d->varblock.g_offset, d->varblock.b_offset);
+            }
+            break;
+        }
+        case 8:
+        {
+            uint8_t *r = (uint8_t *)d->vncbuf;
+            for (x = x0; x < x1; x++, v += sx)
+                r[v] = *c++;
+            break;
+        }
+        case 1:
+        {
+            uint8_t *r = (uint8_t *)d->vncbuf;
+            for (x = x0; x < x1; x++, v += sx)
+                r[v] = ((c[(x - x0) >> 3] >> (7 - (x & 7))) & 0x1) ? 0x00 : 0xFF;
+            break;
+        }
         }
     }
-    else if (vnc_rotate == 0 && bits_per_pixel == 1)
+}
+
+static inline uint32_t vnc_pixel(struct display *d, int v)
+{
+    return d->bits_per_pixel == 32 ? ((uint32_t *)d->vncbuf)[v] : ((uint16_t *)d->vncbuf)[v];
+}
+
+/*
+ * The three 5 bit components of a 15 bit pixel spread over one word, with
+ * room above each for a weight of up to 32, so one multiply blends all of
+ * them at once
+ */
+#define SPREAD_RGB(p) (((p) | ((uint32_t)(p) << 16)) & 0x03E07C1F)
+#define PACK_RGB(s) (((s) | ((s) >> 16)) & 0x7FFF)
+
+/*
+ * Copies one dirty tile of the overlay into its compare buffer and blends
+ * it over the tile convert_tile() has just written to vncbuf.
+ */
+static void composite_tile(struct display *d, int tx, int ty)
+{
+    int x0 = tx * TILE_SIZE;
+    int y0 = ty * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE;
+    int y1 = y0 + TILE_SIZE;
+    int sx = d->varblock.rot_step_x;
+    int bpp = d->ov_bits_per_pixel;
+    int line_bytes = d->scrinfo.xres * bpp / 8;
+    int alpha_shift = d->ov_scrinfo.transp.offset;
+    int alpha_loss = 8 - (int)d->ov_scrinfo.transp.length;
+    uint32_t alpha_max = (1u << d->ov_scrinfo.transp.length) - 1;
+    int y;
+
+    if (x1 > (int)d->scrinfo.xres)
+        x1 = d->scrinfo.xres;
+    if (y1 > (int)d->scrinfo.yres)
+        y1 = d->scrinfo.yres;
+
+    for (y = y0; y < y1; y++)
     {
-        uint8_t *f = (uint8_t *)fbmmap; /* -> framebuffer         */
-        uint8_t *c = (uint8_t *)fbbuf;  /* -> compare framebuffer */
-        uint8_t *r = (uint8_t *)vncbuf; /* -> remote framebuffer  */
+        int offset = y * line_bytes + x0 * bpp / 8;
+        int v = d->varblock.rot_origin + x0 * sx + y * d->varblock.rot_step_y;
+        uint8_t *c = d->ov_buf + offset;
+        int x;
 
-        int xstep = 8;
-        if (memcmp(fbmmap, fbbuf, frame_size) != 0)
+        memcpy(c, d->ov_mmap + offset, (x1 - x0) * bpp / 8);
+
+        for (x = x0; x < x1; x++, v += sx, c += bpp / 8)
         {
-            int y;
-            for (y = 0; y < (int)scrinfo.yres; y++)
+            uint32_t o = bpp == 32 ? *(uint32_t *)c : *(uint16_t *)c;
+            uint32_t a, p;
+
+            if (d->ov_key >= 0)
             {
-                int x;
-                for (x = 0; x < (int)scrinfo.xres; x += xstep)
-                {
-                    uint8_t pixels = *f;
-
-                    if (pixels != *c)
-                    {
-                        *c = pixels;
-                        int bit;
-                        for (bit = 0; bit < 8; bit++)
-                        {
-                            *(r + bit) = ((pixels >> (7 - bit)) & 0x1) ? 0x00 : 0xFF;
-                        }
-
-                        int x2 = x + xstep - 1;
-                        if (x < varblock.min_i)
-                            varblock.min_i = x;
-                        else if (x2 > varblock.max_i)
-                            varblock.max_i = x2;
-
-                        if (y > varblock.max_j)
-                            varblock.max_j = y;
-                        else if (y < varblock.min_j)
-                            varblock.min_j = y;
-                    }
-
-                    f += 1;
-                    c += 1;
-                    r += 8;
-                }
+                a = o == (uint32_t)d->ov_key ? 0 : 32;
             }
+            else
+            {
+                /* to 8 bits, then to 0..32 */
+                a = (o >> alpha_shift) & alpha_max;
+                a = alpha_loss > 0 ? a << alpha_loss : a >> -alpha_loss;
+                a = (a + (a >> 7)) >> 3;
+            }
+            if (a == 0)
+                continue;
+
+            p = ((o >> d->ov_varblock.r_offset) & 0x1F) |
+                (((o >> d->ov_varblock.g_offset) & 0x1F) << 5) |
+                (((o >> d->ov_varblock.b_offset) & 0x1F) << 10);
+            if (a < 32)
+            {
+                uint32_t s = (SPREAD_RGB(p) * a + SPREAD_RGB(vnc_pixel(d, v)) * (32 - a)) >> 5;
+                p = PACK_RGB(s & 0x03E07C1F);
+            }
+
+            if (d->bits_per_pixel == 32)
+                ((uint32_t *)d->vncbuf)[v] = p;
+            else
+                ((uint16_t *)d->vncbuf)[v] = p;
         }
     }
-    else if (vnc_rotate == 0)
+}
+
+/*
+ * Sorts a converted tile by its colour count and by how its neighbouring
+ * pixels differ. Only the 15 bit true colour of 16 and 32 bpp is looked at,
+ * the rest stays flat.
+ */
+static void classify_tile(struct display *d, int tx, int ty)
+{
+    uint32_t colours[FLAT_COLOURS];
+    int ncolours = 0, soft = 0, sharp = 0;
+    int x0 = tx * TILE_SIZE;
+    int y0 = ty * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE;
+    int y1 = y0 + TILE_SIZE;
+    int sx = d->varblock.rot_step_x;
+    int x, y, i;
+
+    if (d->bits_per_pixel != 16 && d->bits_per_pixel != 32)
+    {
+        d->tile_classes[ty * d->tiles_x + tx] = TILE_FLAT;
+        return;
+    }
+
+    if (x1 > (int)d->scrinfo.xres)
+        x1 = d->scrinfo.xres;
+    if (y1 > (int)d->scrinfo.yres)
+        y1 = d->scrinfo.yres;
+
+    for (y = y0; y < y1; y++)
     {
-        uint32_t *f = (uint32_t *)fbmmap; /* -> framebuffer         */
-        uint32_t *c = (uint32_t *)fbbuf;  /* -> compare framebuffer */
-        uint32_t *r = (uint32_t *)vncbuf; /* -> remote framebuffer  */
+        int v = d->varblock.rot_origin + x0 * sx + y * d->varblock.rot_step_y;
+        uint32_t prev = vnc_pixel(d, v);
 
-        if (memcmp(fbmmap, fbbuf, frame_size) != 0)
+        for (x = x0; x < x1; x++, v += sx)
         {
-            int xstep = 4 / bytespp;
+            uint32_t p = vnc_pixel(d, v);
+            int diff;
 
-            int y;
-            for (y = 0; y < (int)scrinfo.yres; y++)
+            if (ncolours <= FLAT_COLOURS)
             {
-                /* Compare every 1/2/4 pixels at a time */
-                int x;
-                for (x = 0; x < (int)scrinfo.xres; x += xstep)
-                {
-                    uint32_t pixel = *f;
-
-                    if (pixel != *c)
-                    {
-                        *c = pixel;
-                        if (bytespp == 4)
-                        {
-                            *r = PIXEL_FB_TO_RFB(pixel,
-                                                 varblock.r_offset, varblock.g_offset, varblock.b_offset);
-                        }
-                        else if (bytespp == 2)
-                        {
-                            *r = PIXEL_FB_TO_RFB(pixel,
-                                                 varblock.r_offset, varblock.g_offset, varblock.b_offset);
-
-                            uint32_t high_pixel = (0xffff0000 & pixel) >> 16;
-                            uint32_t high_r = PIXEL_FB_TO_RFB(high_pixel, varblock.r_offset, varblock.g_offset, varblock.b_offset);
-                            *r |= (0xffff & high_r) << 16;
-                        }
-                        else if (bytespp == 1)
-                        {
-                            *r = pixel;
-                        }
-                        else
-                        {
-                            // TODO
-                        }
-
-                        int x2 = x + xstep - 1;
-                        if (x < varblock.min_i)
-                            varblock.min_i = x;
-                        else if (x2 > varblock.max_i)
-                            varblock.max_i = x2;
-
-                        if (y > varblock.max_j)
-                            varblock.max_j = y;
-                        else if (y < varblock.min_j)
-                            varblock.min_j = y;
-                    }
-
-                    f++;
-                    c++;
-                    r++;
-                }
+                for (i = 0; i < ncolours && colours[i] != p; i++)
+                    ;
+                if (i == ncolours && ncolours++ < FLAT_COLOURS)
+                    colours[i] = p;
             }
+
+            diff = abs((int)(p & 0x1F) - (int)(prev & 0x1F)) +
+                   abs((int)((p >> 5) & 0x1F) - (int)((prev >> 5) & 0x1F)) +
+                   abs((int)((p >> 10) & 0x1F) - (int)((prev >> 10) & 0x1F));
+            if (diff > SHARP_STEP)
+                sharp++;
+            else if (diff > 0)
+                soft++;
+            prev = p;
         }
-    } else if (bits_per_pixel == 16) {
-        uint16_t *f = (uint16_t *)fbmmap; /* -> framebuffer         */
-        uint16_t *c = (uint16_t *)fbbuf;  /* -> compare framebuffer */
-        uint16_t *r = (uint16_t *)vncbuf; /* -> remote framebuffer  */
+    }
+
+    if (ncolours <= FLAT_COLOURS)
+        d->tile_classes[ty * d->tiles_x + tx] = TILE_FLAT;
+    else if (soft > 2 * sharp)
+        d->tile_classes[ty * d->tiles_x + tx] = TILE_PHOTO;
+    else
+        d->tile_classes[ty * d->tiles_x + tx] = TILE_DETAIL;
+}
+
+/*
+ * Compares the wanted span [tx0, tx1) of line y of one plane, f the
+ * framebuffer and c its compare buffer. Returns 1 if it changed.
+ */
+static int compare_plane_line(struct display *d, const uint8_t *f, const uint8_t *c, int bpp,
+                              int y, int tx0, int tx1, unsigned char *dirty, const unsigned char *wanted)
+{
+    int tx;
+    int tile_bytes = TILE_SIZE * bpp / 8;
+    int line_bytes = d->scrinfo.xres * bpp / 8;
+    int offset = y * line_bytes + tx0 * tile_bytes;
+    int end = tx1 == d->tiles_x ? (y + 1) * line_bytes : y * line_bytes + tx1 * tile_bytes;
+
+    if (memcmp(f + offset, c + offset, end - offset) == 0)
+        return 0;
+
+    for (tx = tx0; tx < tx1; tx++)
+    {
+        int toffset = y * line_bytes + tx * tile_bytes;
+        int len = (tx == d->tiles_x - 1) ? line_bytes - tx * tile_bytes : tile_bytes;
+
+        if (wanted[tx] && !dirty[tx] && memcmp(f + toffset, c + toffset, len) != 0)
+            dirty[tx] = 1;
+    }
+    return 1;
+}
+
+/* A tile is dirty if it changed on the display or on its overlay plane */
+static int compare_line(struct display *d, int y, int tx0, int tx1, unsigned char *dirty, const unsigned char *wanted)
+{
+    int changed = compare_plane_line(d, (uint8_t *)d->fbmmap, (uint8_t *)d->fbbuf, d->bits_per_pixel,
+                                     y, tx0, tx1, dirty, wanted);
+
+    if (d->ov_fd != -1)
+        changed |= compare_plane_line(d, d->ov_mmap, d->ov_buf, d->ov_bits_per_pixel,
+                                      y, tx0, tx1, dirty, wanted);
+    return changed;
+}
+
+/*
+ * Marks the dirty tiles of tile rows [ty0, ty1). With a scan_step over 1
+ * only every scan_step'th line is compared first; a tile row where one of
+ * them changed is then compared whole, so the rest of a change that showed
+ * on a sampled line is not left to the following captures.
+ */
+static void compare_band(struct display *d, int ty0, int ty1)
+{
+    int ty, y;
+
+    memset(d->dirty_tiles + ty0 * d->tiles_x, 0, (ty1 - ty0) * d->tiles_x);
 
-        switch (vnc_rotate)
+    for (ty = ty0; ty < ty1; ty++)
+    {
+        unsigned char *dirty = d->dirty_tiles + ty * d->tiles_x;
+        unsigned char *wanted = d->wanted_tiles + ty * d->tiles_x;
+        int y0 = ty * TILE_SIZE;
+        int y1 = y0 + TILE_SIZE;
+        int tx0 = 0, tx1 = d->tiles_x;
+        int changed = 0;
+
+        if (y1 > (int)d->scrinfo.yres)
+            y1 = d->scrinfo.yres;
+
+        /*
+         * Only the span of wanted tiles of a line is compared as a whole
+         * first, single tiles only inside the lines that changed
+         */
+        while (tx0 < tx1 && !wanted[tx0])
+            tx0++;
+        while (tx1 > tx0 && !wanted[tx1 - 1])
+            tx1--;
+        if (tx0 == tx1)
+            continue;
+
+        for (y = y0; y < y1; y++)
         {
-        case 0:
-        case 180:
-            server->width = scrinfo.xres;
-            server->height = scrinfo.yres;
-            server->paddedWidthInBytes = scrinfo.xres * bytespp;
-            break;
+            if (scan_step == 1 || y % scan_step == d->scan_phase)
+                changed |= compare_line(d, y, tx0, tx1, dirty, wanted);
+        }
 
-        case 90:
-        case 270:
-            server->width = scrinfo.yres;
-            server->height = scrinfo.xres;
-            server->paddedWidthInBytes = scrinfo.yres * bytespp;
-            break;
+        if (!changed || scan_step == 1)
+            continue;
+
+        for (y = y0; y < y1; y++)
+        {
+            if (y % scan_step != d->scan_phase)
+                compare_line(d, y, tx0, tx1, dirty, wanted);
         }
+    }
+}
+
+/*
+ * Compares and converts one horizontal band of the framebuffer. Bands are
+ * whole tile rows, so every worker owns its part of dirty_tiles, fbbuf and
+ * vncbuf and no locking is needed.
+ */
+static void scan_band(int index, int count)
+{
+    struct display *d = scanning;
+    int ty0 = d->tiles_y * index / count;
+    int ty1 = d->tiles_y * (index + 1) / count;
+    int tx, ty;
+
+    if (full_scan)
+        memset(d->dirty_tiles + ty0 * d->tiles_x, 1, (ty1 - ty0) * d->tiles_x);
+    else
+        compare_band(d, ty0, ty1);
 
-        if (memcmp(fbmmap, fbbuf, frame_size) != 0) {
-            int y;
-            for (y = 0; y < (int)scrinfo.yres; y++)
+    for (ty = ty0; ty < ty1; ty++)
+    {
+        for (tx = 0; tx < d->tiles_x; tx++)
+        {
+            if (d->dirty_tiles[ty * d->tiles_x + tx])
             {
-                /* Compare every pixels at a time */
-                int x;
-                for (x = 0; x < (int)scrinfo.xres; x++)
-                {
-                    uint16_t pixel = *f;
-
-                    if (pixel != *c)
-                    {
-                        int x2, y2;
-
-                        *c = pixel;
-                        switch (vnc_rotate)
-                        {
-                        case 0:
-                            x2 = x;
-                            y2 = y;
-                            break;
-
-                        case 90:
-                            x2 = scrinfo.yres - 1 - y;
-                            y2 = x;
-                            break;
-
-                        case 180:
-                            x2 = scrinfo.xres - 1 - x;
-                            y2 = scrinfo.yres - 1 - y;
-                            break;
-
-                        case 270:
-                            x2 = y;
-                            y2 = scrinfo.xres - 1 - x;
-                            break;
-                        default:
-                            error_print("rotation is invalid\n");
-                            exit(EXIT_FAILURE);
-                        }
-
-                        r[y2 * server->width + x2] = PIXEL_FB_TO_RFB(pixel, varblock.r_offset, varblock.g_offset, varblock.b_offset);
-
-                        if (x2 < varblock.min_i)
-                            varblock.min_i = x2;
-                        else
-                        {
-                            if (x2 > varblock.max_i)
-                                varblock.max_i = x2;
-
-                            if (y2 > varblock.max_j)
-                                varblock.max_j = y2;
-                            else if (y2 < varblock.min_j)
-                                varblock.min_j = y2;
-                        }
-                    }
-
-                    f++;
-                    c++;
-                }
+                convert_tile(d, tx, ty);
+                if (d->ov_fd != -1)
+                    composite_tile(d, tx, ty);
+                if (tune_jpeg)
+                    classify_tile(d, tx, ty);
             }
         }
-    } else {
-        exit(EXIT_FAILURE);
     }
+}
+
+static void update_screen(struct display *d)
+{
+/*
+if (pass_update_screen == 0 && !timeToLogFPS()) {
+   	info_print("pass_update_screen");
+	pass_update_screen = 1;
+	return;
+   }
+*/
+   static int frames = 0;
+   frames++;
+   if (0 && timeToLogFPS())
+   {
+       double fps = frames / LOG_TIME;
+       info_print("  fps: %f\n", fps);
+       frames = 0;
+   }
 
-    if (varblock.min_i < 9999) {
-        if (varblock.max_i < 0)
-            varblock.max_i = varblock.min_i;
+    int i;
+    int nrects;
+    int primary = d == &displays[0];
+    struct dirty_rect *rects;
 
-        if (varblock.max_j < 0)
-            varblock.max_j = varblock.min_j;
-	
-        rfbMarkRectAsModified(server, varblock.min_i, varblock.min_j, varblock.max_i + 2, varblock.max_j + 1);
-	
-        if (trim5 == 1) {
-            rfbProcessEvents(server, 90000);
-        } else {
-            rfbProcessEvents(server, 10000);
-        }
+    scanning = d;
+    run_workers(scan_band);
+    d->scan_phase = (d->scan_phase + 1) % scan_step;
+
+    /* a full scan says nothing about what changed */
+    if (!full_scan && primary)
+        heat_update(d->dirty_tiles);
+
+    nrects = build_dirty_rects(d->dirty_tiles, d->tiles_x, d->tiles_y, primary ? heat_hot_tiles() : NULL,
+                               max_rects, rect_cost / (TILE_SIZE * TILE_SIZE), &rects);
+
+    for (i = 0; i < nrects; i++)
+    {
+        int x1 = rects[i].x1 * TILE_SIZE;
+        int y1 = rects[i].y1 * TILE_SIZE;
+        int x2 = rects[i].x2 * TILE_SIZE;
+        int y2 = rects[i].y2 * TILE_SIZE;
+
+        if (x2 > (int)d->scrinfo.xres)
+            x2 = d->scrinfo.xres;
+        if (y2 > (int)d->scrinfo.yres)
+            y2 = d->scrinfo.yres;
+
+        rotate_rect(d, &x1, &y1, &x2, &y2);
+        mark_rect_modified(d->server, x1, y1, x2, y2);
+        if (!primary)
+            continue;
+        keyframe_invalidate(x1, y1, x2, y2);
+        palette_scan(x1, y1, x2, y2);
+        if (d->server->clientHead != NULL)
+            record_update(x1, y1, x2, y2);
+    }
+
+    if (nrects > 0 && primary)
+    {
+        keyframe_refresh((char *)d->vncbuf);
+        palette_commit();
+        thumb_frame_changed();
     }
 }
 
 
+/* msec since boot, of now or of the start of the process */
+static long boot_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static long exec_boot_msec(void)
+{
+    char buf[512], *p;
+    unsigned long long start;
+    FILE *f = fopen("/proc/self/stat", "r");
+
+    if (f == NULL)
+        return -1;
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    /* starttime is the 22nd field, the name before it may hold blanks */
+    if (p == NULL || (p = strrchr(buf, ')')) == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+               &start) != 1)
+        return -1;
+    return start * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * How long the panel was without remote access after a power cycle: the
+ * dynamic loading before main(), the framebuffers and servers, the event
+ * loop and listeners. Logged on every start, -b starts, logs and exits.
+ */
+static void log_startup(long exec_at, long main_at, long server_at)
+{
+    long ready_at = boot_msec();
+
+    info_print("ready %ld ms after boot, %ld ms after exec: loading %ld ms, framebuffers and servers %ld ms, "
+               "event loop and listeners %ld ms\n", ready_at, exec_at >= 0 ? ready_at - exec_at : -1,
+               exec_at >= 0 ? main_at - exec_at : -1, server_at - main_at, ready_at - server_at);
+}
+
 void print_usage(char **argv)
 {
 	//todo: impl
@@ -923,7 +1669,97 @@ static int my_ini_handler(void* user, const char* section, const char* name,
     
     #define MATCH(s, n) strcmp(section, s) == 0 && strcmp(name, n) == 0
     
-    if (strcmp(section, "admins") == 0) {
+    if (MATCH("settings", "rotate")) {
+        vnc_rotate = atoi(value);
+    } else if (MATCH("settings", "max_rects")) {
+        max_rects = atoi(value);
+        if (max_rects < 1)
+            max_rects = 1;
+    } else if (MATCH("settings", "rect_cost")) {
+        rect_cost = atoi(value);
+    } else if (MATCH("settings", "workers")) {
+        scan_workers = atoi(value);
+    } else if (MATCH("settings", "keyframe")) {
+        keyframe = atoi(value);
+    } else if (MATCH("settings", "client_queue")) {
+        client_queue = atoi(value);
+    } else if (MATCH("settings", "client_lag")) {
+        client_lag = atoi(value);
+    } else if (MATCH("settings", "tune_jpeg")) {
+        tune_jpeg = atoi(value);
+    } else if (MATCH("settings", "photo_quality")) {
+        photo_quality = atoi(value);
+        if (photo_quality > 100)
+            photo_quality = 100;
+    } else if (MATCH("settings", "palette_colours")) {
+        palette_colours = atoi(value);
+        if (palette_colours > 256)
+            palette_colours = 256;
+    } else if (MATCH("settings", "interlace")) {
+        interlace = atoi(value);
+        if (interlace < 1)
+            interlace = 1;
+        if (interlace > TILE_SIZE)
+            interlace = TILE_SIZE;
+    } else if (MATCH("settings", "cold_scan")) {
+        cold_scan = atoi(value);
+        if (cold_scan < 1)
+            cold_scan = 1;
+    } else if (MATCH("settings", "heat_file")) {
+        snprintf(heat_file, sizeof(heat_file), "%s", value);
+    } else if (MATCH("settings", "record_file")) {
+        snprintf(record_file, sizeof(record_file), "%s", value);
+    } else if (MATCH("settings", "record_size")) {
+        record_size = atoi(value);
+    } else if (MATCH("settings", "thumb_file")) {
+        snprintf(thumb_file, sizeof(thumb_file), "%s", value);
+    } else if (MATCH("settings", "thumb_socket")) {
+        snprintf(thumb_socket, sizeof(thumb_socket), "%s", value);
+    } else if (MATCH("settings", "thumb_width")) {
+        thumb_width = atoi(value);
+    } else if (MATCH("settings", "thumb_quality")) {
+        thumb_quality = atoi(value);
+    } else if (MATCH("settings", "thumb_interval")) {
+        thumb_interval = atoi(value);
+    } else if (MATCH("settings", "ws_port")) {
+        ws_port = atoi(value);
+    } else if (MATCH("settings", "http_dir")) {
+        snprintf(http_dir, sizeof(http_dir), "%s", value);
+    } else if (MATCH("settings", "http_port")) {
+        http_port = atoi(value);
+    } else if (MATCH("settings", "reverse_hosts")) {
+        snprintf(reverse_hosts, sizeof(reverse_hosts), "%s", value);
+    } else if (MATCH("settings", "reverse_id")) {
+        snprintf(reverse_id, sizeof(reverse_id), "%s", value);
+    } else if (MATCH("settings", "reverse_retry")) {
+        reverse_retry = atoi(value);
+    } else if (MATCH("settings", "extra_fb")) {
+        snprintf(extra_fb, sizeof(extra_fb), "%s", value);
+    } else if (MATCH("settings", "overlay_fb")) {
+        snprintf(overlay_fb, sizeof(overlay_fb), "%s", value);
+    } else if (MATCH("settings", "overlay_key")) {
+        overlay_key = value[0] != '\0' ? strtol(value, NULL, 0) : -1;
+    } else if (MATCH("settings", "cpu_budget")) {
+        cpu_budget = atoi(value);
+    } else if (MATCH("settings", "capture_cpus")) {
+        if (!parse_cpu_list(value, &capture_sched))
+            error_print("invalid capture_cpus %s\n", value);
+    } else if (MATCH("settings", "capture_policy")) {
+        if (!parse_sched_policy(value, &capture_sched))
+            error_print("invalid capture_policy %s\n", value);
+    } else if (MATCH("settings", "capture_priority")) {
+        if (!parse_sched_priority(value, &capture_sched))
+            error_print("invalid capture_priority %s\n", value);
+    } else if (MATCH("settings", "network_cpus")) {
+        if (!parse_cpu_list(value, &network_sched))
+            error_print("invalid network_cpus %s\n", value);
+    } else if (MATCH("settings", "network_policy")) {
+        if (!parse_sched_policy(value, &network_sched))
+            error_print("invalid network_policy %s\n", value);
+    } else if (MATCH("settings", "network_priority")) {
+        if (!parse_sched_priority(value, &network_sched))
+            error_print("invalid network_priority %s\n", value);
+    } else if (strcmp(section, "admins") == 0) {
         add_pwd_info(value, 2);
     } else if (strcmp(section, "users") == 0 ) {
         add_pwd_info(value, 1);
@@ -935,6 +1771,443 @@ static int my_ini_handler(void* user, const char* section, const char* name,
     return 1;
 }
 
+static void free_pwd_info(void)
+{
+    int k;
+    for (k = 0; k < pwds_info_count; ++k) {
+        free(pwds_info_data[k]->pwd);
+        free(pwds_info_data[k]);
+        pwds_info_data[k] = NULL;
+        passwords[k] = NULL;
+    }
+    pwds_info_count = 0;
+}
+
+/*
+ * Passwords and the tunables are taken over on the fly when the config
+ * file is rewritten. Rotation, displays, workers and thread placement need
+ * a restart.
+ */
+static void reload_config(int fd, void *arg)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *name = strrchr(CONFIG_FILE, '/') + 1;
+    int changed = 0;
+    ssize_t len;
+
+    UNUSED(arg);
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        char *p;
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, name) == 0)
+                changed = 1;
+        }
+    }
+
+    if (!changed)
+        return;
+
+    int rotate = vnc_rotate;
+    int workers = scan_workers;
+
+    free_pwd_info();
+    if (ini_parse(CONFIG_FILE, my_ini_handler, pwds_info_data) < 0) {
+        error_print("Can't reload '%s'\n", CONFIG_FILE);
+    } else {
+        info_print("'%s' reloaded\n", CONFIG_FILE);
+    }
+
+    vnc_rotate = rotate;
+    scan_workers = workers;
+    init_cpu_budget(cpu_budget);
+    evloop_set_output_limits(client_queue * 1024, client_lag * 1000);
+}
+
+static void watch_config(void)
+{
+    char dir[256];
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd == -1) {
+        error_print("inotify_init failed, %s\n", strerror(errno));
+        return;
+    }
+
+    /* editors replace the file, so the directory is watched */
+    snprintf(dir, sizeof(dir), "%s", CONFIG_FILE);
+    *strrchr(dir, '/') = '\0';
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1 ||
+        !evloop_add_fd(fd, reload_config, NULL)) {
+        error_print("cannot watch %s\n", CONFIG_FILE);
+        close(fd);
+    }
+}
+
+/*
+ * Follows the degrade level of the CPU budget governor. Compression levels
+ * the clients asked for are kept and given back when the level drops.
+ */
+static void apply_budget_level(struct display *d)
+{
+    int level = cpu_budget_level();
+    rfbClientIteratorPtr it;
+    rfbClientPtr cl;
+
+    if (level >= BUDGET_SCAN_QUARTER)
+        scan_step = 4;
+    else if (level >= BUDGET_SCAN_HALF)
+        scan_step = 2;
+    else
+        scan_step = 1;
+    if (scan_step < interlace)
+        scan_step = interlace;
+    d->scan_phase %= scan_step;
+
+    it = rfbGetClientIterator(d->server);
+    while ((cl = rfbClientIteratorNext(it)) != NULL)
+    {
+        struct client_data *cd = cl->clientData;
+
+        if (cd == NULL)
+            continue;
+
+        if (level >= BUDGET_ENCODING) {
+            /* the client may have sent SetEncodings since */
+            if (!cd->degraded || cl->tightCompressLevel > 1 || cl->zlibCompressLevel > 1) {
+                cd->tight_compress_level = cl->tightCompressLevel;
+                cd->zlib_compress_level = cl->zlibCompressLevel;
+                cd->degraded = 1;
+            }
+            if (cl->tightCompressLevel > 1)
+                cl->tightCompressLevel = 1;
+            if (cl->zlibCompressLevel > 1)
+                cl->zlibCompressLevel = 1;
+        } else if (cd->degraded) {
+            cl->tightCompressLevel = cd->tight_compress_level;
+            cl->zlibCompressLevel = cd->zlib_compress_level;
+            cd->degraded = 0;
+        }
+    }
+    rfbReleaseClientIterator(it);
+}
+
+/*
+ * Marks the tiles under the union of the pending update requests of all
+ * clients, only those are compared. Returns 0 if nobody waits for an update.
+ */
+static int collect_requests(struct display *d)
+{
+    rfbClientIteratorPtr it;
+    rfbClientPtr cl;
+    int wanted = 0;
+
+    memset(d->wanted_tiles, 0, d->tiles_x * d->tiles_y);
+
+    it = rfbGetClientIterator(d->server);
+    while ((cl = rfbClientIteratorNext(it)) != NULL)
+    {
+        sraRectangleIterator *ri;
+        sraRect r;
+
+        if (cl->state != RFB_NORMAL || sraRgnEmpty(cl->requestedRegion))
+            continue;
+
+        ri = sraRgnGetIterator(cl->requestedRegion);
+        while (sraRgnIteratorNext(ri, &r))
+        {
+            int tx, ty;
+
+            unrotate_rect(d, &r.x1, &r.y1, &r.x2, &r.y2);
+            if (r.x1 < 0)
+                r.x1 = 0;
+            if (r.y1 < 0)
+                r.y1 = 0;
+            if (r.x2 > (int)d->scrinfo.xres)
+                r.x2 = d->scrinfo.xres;
+            if (r.y2 > (int)d->scrinfo.yres)
+                r.y2 = d->scrinfo.yres;
+
+            for (ty = r.y1 / TILE_SIZE; ty * TILE_SIZE < r.y2; ty++)
+                for (tx = r.x1 / TILE_SIZE; tx * TILE_SIZE < r.x2; tx++)
+                    d->wanted_tiles[ty * d->tiles_x + tx] = 1;
+            wanted = 1;
+        }
+        sraRgnReleaseIterator(ri);
+    }
+    rfbReleaseClientIterator(it);
+
+    return wanted;
+}
+
+/*
+ * With no clients the shadow buffers are given back to the kernel and
+ * nothing runs until a client connects; its hook restarts the capture timer.
+ */
+static void enter_dormant(struct display *d)
+{
+    madvise(d->fbbuf, d->frame_size, MADV_DONTNEED);
+    madvise(d->vncbuf, d->vncbuf_size, MADV_DONTNEED);
+    if (d->ov_fd != -1)
+        madvise(d->ov_buf, d->ov_frame_size, MADV_DONTNEED);
+    if (d == &displays[0])
+        keyframe_release();
+    d->dormant = 1;
+    debug_print("no clients on %s, dormant\n", d->fb_device);
+}
+
+/* The dropped buffers read back as zeroes, so the first frame is rebuilt whole */
+static void leave_dormant(struct display *d)
+{
+    d->dormant = 0;
+    full_scan = 1;
+    update_screen(d);
+    full_scan = 0;
+}
+
+static void drop_overlay(struct display *d)
+{
+    munmap(d->ov_mmap, d->ov_frame_size);
+    munmap(d->ov_buf, d->ov_frame_size);
+    close(d->ov_fd);
+    d->ov_fd = -1;
+}
+
+/*
+ * The HMI runtime switched the framebuffer to another mode. Everything
+ * sized by it is made again, the clients get the new size with NewFBSize
+ * and then the whole new frame.
+ */
+static void resize_display(struct display *d, const struct fb_var_screeninfo *mode)
+{
+    int primary = d == &displays[0];
+    unsigned short int *old_vncbuf = d->vncbuf;
+    size_t old_vncbuf_size = d->vncbuf_size;
+    rfbClientIteratorPtr it;
+    rfbClientPtr cl;
+
+    info_print("%s is now %dx%d %d bpp\n", d->fb_device, mode->xres, mode->yres, mode->bits_per_pixel);
+
+    munmap(d->fbmap, d->map_size);
+    free_shadows(d);
+    d->scrinfo = *mode;
+    map_fb(d);
+    init_shadows(d);
+
+    /* the palette of the old format must not translate for the new one */
+    if (primary)
+    {
+        cleanup_palette();
+        d->server->setTranslateFunction = rfbSetTranslateFunction;
+    }
+    rfbNewFramebuffer(d->server, (char *)d->vncbuf, d->varblock.rfb_xres, d->varblock.rfb_maxy + 1,
+                      BITS_PER_SAMPLE, SAMPLES_PER_PIXEL, rfb_bytespp(d));
+    munmap(old_vncbuf, old_vncbuf_size);
+
+    if (primary)
+    {
+        if (d->ov_fd != -1)
+        {
+            drop_overlay(d);
+            init_overlay(d, overlay_fb, overlay_key);
+        }
+        cleanup_heat();
+        if (!init_heat(d->tiles_x, d->tiles_y))
+            exit(EXIT_FAILURE);
+        if (keyframe)
+        {
+            cleanup_keyframe();
+            if (!init_keyframe(d->server->width, d->server->height, rfb_bytespp(d)))
+                keyframe = 0;
+        }
+        if (palette_colours > 0 && init_palette(d->server, palette_colours))
+        {
+            /* colour-mapped clients are taken onto the palette again */
+            it = rfbGetClientIterator(d->server);
+            while ((cl = rfbClientIteratorNext(it)) != NULL)
+                d->server->setTranslateFunction(cl);
+            rfbReleaseClientIterator(it);
+        }
+        record_resized();
+        detect_trim5(d);
+    }
+
+    if (!d->dormant)
+    {
+        full_scan = 1;
+        update_screen(d);
+        full_scan = 0;
+    }
+}
+
+/*
+ * One ioctl per capture: the mode in use is compared with the current one
+ * and the page on display followed. After a flip the new page is compared
+ * with the shadow of the page shown before, all of it in one capture, so
+ * only what differs between the two is converted and sent.
+ */
+static void check_mode(struct display *d)
+{
+    struct fb_var_screeninfo now;
+    struct fb_var_screeninfo *was = &d->scrinfo;
+
+    if (ioctl(d->fbfd, FBIOGET_VSCREENINFO, &now) != 0)
+        return;
+    if (now.xres == was->xres && now.yres == was->yres &&
+        now.xres_virtual == was->xres_virtual && now.yres_virtual == was->yres_virtual &&
+        now.bits_per_pixel == was->bits_per_pixel &&
+        now.red.offset == was->red.offset && now.red.length == was->red.length &&
+        now.green.offset == was->green.offset && now.green.length == was->green.length &&
+        now.blue.offset == was->blue.offset && now.blue.length == was->blue.length)
+    {
+        if (now.yoffset != was->yoffset)
+        {
+            was->yoffset = now.yoffset;
+            show_page(d, now.yoffset);
+            d->flipped = 1;
+        }
+        return;
+    }
+    if (now.xres == 0 || now.yres == 0 || now.bits_per_pixel == 0)
+        return;
+    resize_display(d, &now);
+}
+
+/*
+ * Restarts the capture once an update request is pending. The first update
+ * request of a client is answered from the keyframe when the client can
+ * take it, the rest goes through libvncserver as usual.
+ */
+static void client_message(rfbClientPtr cl)
+{
+    struct client_data *cd = cl->clientData;
+    struct display *d = cl->screen->screenData;
+
+    if (cd == NULL || cl->state != RFB_NORMAL || sraRgnEmpty(cl->requestedRegion))
+        return;
+
+    if (d->capture_waiting) {
+        d->capture_waiting = 0;
+        evloop_schedule_capture(0);
+    }
+
+    if (cd->first_request)
+        return;
+
+    cd->first_request = 1;
+    if (keyframe && d == &displays[0] && !d->dormant && keyframe_send(cl, (char *)d->vncbuf))
+        debug_print("keyframe sent to %s\n", cl->host);
+}
+
+/*
+ * Tiles that have not changed for a while are compared on every
+ * cold_scan'th capture and after input only.
+ */
+static void skip_cold_tiles(void)
+{
+    static int phase = 0;
+
+    if (phase != 0 && !input_seen)
+        heat_skip_cold(displays[0].wanted_tiles);
+    phase = (phase + 1) % cold_scan;
+    input_seen = 0;
+}
+
+static void dump_heat(void)
+{
+    static time_t next_dump = 0;
+    time_t now = time(NULL);
+
+    if (heat_file[0] == '\0' || now < next_dump)
+        return;
+    next_dump = now + HEAT_DUMP_INTERVAL;
+    heat_dump(heat_file);
+}
+
+/* Wakes the capture for the next thumbnail while nobody else needs it */
+static void schedule_thumb(void)
+{
+    long usec = thumbs ? thumb_wait() : -1;
+
+    if (usec >= 0)
+        evloop_schedule_capture(usec);
+}
+
+/*
+ * Captures one display for its clients, returns 0 if it waits for a client
+ * or an update request instead. A thumbnail is made from a capture of the
+ * whole screen; while thumbnails are made the shadow buffers are kept, so
+ * only what changed since the last one is converted. They are kept between
+ * reverse sessions too, a session that comes back gets the keyframe
+ * without waiting for a full capture.
+ */
+static int capture_display(struct display *d, int snapshot)
+{
+    int primary = d == &displays[0];
+
+    if (d->server->clientHead == NULL && !snapshot) {
+        if (!d->dormant && !(primary && (thumbs || reverse)))
+            enter_dormant(d);
+        return 0;
+    }
+
+    check_mode(d);
+    if (d->dormant) {
+        leave_dormant(d);
+        return 1;
+    }
+
+    apply_budget_level(d);
+    if (!collect_requests(d) && !snapshot) {
+        /* the next update request restarts the timer */
+        d->capture_waiting = 1;
+        return 0;
+    }
+    if (snapshot)
+        memset(d->wanted_tiles, 1, d->tiles_x * d->tiles_y);
+    else if (primary && !d->flipped)
+        skip_cold_tiles();
+    if (d->flipped)
+    {
+        /*
+         * A flip may change any tile: no cold tile is skipped and no line
+         * left to a later pass, the compare still sends only what differs
+         */
+        int step = scan_step;
+        int phase = d->scan_phase;
+
+        scan_step = 1;
+        update_screen(d);
+        scan_step = step;
+        d->scan_phase = phase;
+        d->flipped = 0;
+    }
+    else
+        update_screen(d);
+    if (primary)
+        dump_heat();
+    return 1;
+}
+
+/* Runs on the capture timer of the event loop, shared by all displays */
+static void capture_tick(void)
+{
+    int snapshot = thumbs && thumb_due();
+    int captured = 0;
+    int i;
+
+    for (i = 0; i < ndisplays; i++)
+        captured |= capture_display(&displays[i], i == 0 && snapshot);
+
+    if (snapshot)
+        thumb_write();
+    if (captured)
+        evloop_schedule_capture(proc_time + cpu_budget_throttle());
+    else
+        schedule_thumb();
+}
+
 int main(int argc, char **argv)
 {
     /*
@@ -945,16 +2218,22 @@ int main(int argc, char **argv)
 
     rfbLogEnable(FALSE);
 
-    static int proc_time = 500000;
     static int fps = 0;
-    if (ini_parse("/etc/vncaccess.ini", my_ini_handler, pwds_info_data) < 0) {
-        printf("Can't load '/etc/vncaccess.ini'\n");
+    struct display *d = &displays[0];
+    int i;
+    int bench = 0;
+    long exec_at = exec_boot_msec();
+    long main_at = boot_msec();
+    long server_at;
+
+    if (ini_parse(CONFIG_FILE, my_ini_handler, pwds_info_data) < 0) {
+        printf("Can't load '%s'\n", CONFIG_FILE);
         return 1;
     }
 
     if (argc > 1)
     {
-        int i = 1;
+        i = 1;
         while (i < argc)
         {
             if (*argv[i] == '-')
@@ -981,13 +2260,20 @@ int main(int argc, char **argv)
                     i++;
                     matrix = 1;
                     break;
+                case 'b':
+                    bench = 1;
+                    break;
                 }
             }
             i++;
         }
     }
 
-    init_fb();
+    init_displays();
+    for (i = 0; i < ndisplays; i++)
+        init_fb(&displays[i]);
+    if (overlay_fb[0] != '\0')
+        init_overlay(d, overlay_fb, overlay_key);
     if (strlen(kbd_device) > 0) {
         kbdfd  = init_kbd(kbd_device);
     }
@@ -998,7 +2284,7 @@ int main(int argc, char **argv)
         enable_touch = (ret > 0);
     }
     init_fb_server(argc, argv, enable_touch);
-
+    server_at = boot_msec();
 
 
     if (trim5 == 1) {
@@ -1007,16 +2293,38 @@ int main(int argc, char **argv)
         proc_time = (fps == 0 ? 330000 : 50000);
     }
 
-    for(;;) {
-        while (server->clientHead == NULL) {
-           rfbProcessEvents(server, 100000);
-        }
-        
-        rfbProcessEvents(server, proc_time);
-        update_screen();
-    }
+    apply_thread_sched(&network_sched, "network");
+    init_cpu_budget(cpu_budget);
 
-    cleanup_fb();
+    if (!init_evloop())
+        exit(EXIT_FAILURE);
+    for (i = 0; i < ndisplays; i++)
+        evloop_add_screen(displays[i].server);
+    evloop_set_capture(capture_tick);
+    evloop_set_client_hook(client_message);
+    evloop_set_output_limits(client_queue * 1024, client_lag * 1000);
+    watch_config();
+    thumbs = init_thumb(d->server, thumb_file, thumb_socket, thumb_width, thumb_quality, thumb_interval);
+    schedule_thumb();
+    init_websock(d->server, ws_port);
+    reverse = init_reverse(d->server, reverse_hosts, reverse_id, reverse_retry);
+    log_startup(exec_at, main_at, server_at);
+
+    if (!bench)
+        run_evloop();
+
+    cleanup_evloop();
+    cleanup_workers();
+    for (i = 0; i < ndisplays; i++)
+        cleanup_fb(&displays[i]);
+    cleanup_rects();
+    cleanup_heat();
+    cleanup_keyframe();
+    cleanup_palette();
+    cleanup_record();
+    cleanup_thumb();
+    cleanup_websock();
+    cleanup_reverse();
     cleanup_kbd();
     cleanup_touch();
 }
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+#include "rfb/rfbregion.h"
+
+#include "palette.h"
+#include "logging.h"
+
+/*
+ * Live colour map for clients that ask for an 8 bit colour-mapped pixel
+ * format, which libvncserver serves with a fixed BGR233 map that only
+ * approximates the HMI colours. The server stays true colour: every colour
+ * on screen gets an index, the clients get the map with SetColourMapEntries
+ * and translate pixels by looking them up. While the screen holds more
+ * than max_colours they fall back to BGR233, until a recount finds the
+ * colour set small enough again.
+ */
+
+#define UNMAPPED 0xFFFF
+/* seconds between recounts of an overflowed screen */
+#define RECOUNT_INTERVAL 10
+
+static rfbScreenInfoPtr screen;
+static uint16_t *index_of;  /* 15 bit colour -> map index */
+static uint16_t colours[256];
+static int ncolours;
+static int sent_colours;    /* map entries the palette clients have */
+static int max_colours;
+static int overflow;
+static int stale;           /* nobody used the map, colours were not tracked */
+static time_t recount_at;
+
+/* What the client asked for, libvncserver overwrites cl->format with BGR233 */
+struct palette_client
+{
+    int colour_mapped;
+};
+
+static rfbBool palette_set_translate(rfbClientPtr cl);
+static rfbBool pal_new_client(rfbClientPtr cl, void **data);
+static void pal_close(rfbClientPtr cl, void *data);
+
+static rfbProtocolExtension palette_extension = {
+    pal_new_client,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    pal_close,
+    NULL,
+    NULL,
+    NULL
+};
+
+static rfbBool pal_new_client(rfbClientPtr cl, void **data)
+{
+    (void)cl;
+    *data = calloc(1, sizeof(struct palette_client));
+    return *data != NULL;
+}
+
+static void pal_close(rfbClientPtr cl, void *data)
+{
+    (void)cl;
+    free(data);
+}
+
+int init_palette(rfbScreenInfoPtr s, int max)
+{
+    rfbPixelFormat *f = &s->serverFormat;
+
+    if (max < 2)
+        return 0;
+    if ((f->bitsPerPixel != 16 && f->bitsPerPixel != 32) || !f->trueColour ||
+        f->redMax != 31 || f->greenMax != 31 || f->blueMax != 31 ||
+        (1 << f->redShift | 1 << f->greenShift | 1 << f->blueShift) != (1 << 0 | 1 << 5 | 1 << 10))
+    {
+        info_print("palette off, the screen is not 15 bit true colour\n");
+        return 0;
+    }
+
+    index_of = malloc(32768 * sizeof(uint16_t));
+    if (index_of == NULL)
+    {
+        error_print("cannot allocate palette index\n");
+        return 0;
+    }
+
+    screen = s;
+    max_colours = max > 256 ? 256 : max;
+    stale = 1;
+    rfbRegisterProtocolExtension(&palette_extension);
+    screen->setTranslateFunction = palette_set_translate;
+    return 1;
+}
+
+void cleanup_palette()
+{
+    free(index_of);
+    index_of = NULL;
+    screen = NULL;
+}
+
+static void palette_translate(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
+                              char *iptr, char *optr, int bytesBetweenInputLines,
+                              int width, int height)
+{
+    uint8_t *o = (uint8_t *)optr;
+    int x;
+
+    (void)table;
+    (void)out;
+    while (height-- > 0)
+    {
+        if (in->bitsPerPixel == 16)
+        {
+            const uint16_t *p = (const uint16_t *)iptr;
+            for (x = 0; x < width; x++)
+                *o++ = index_of[p[x] & 0x7FFF];
+        }
+        else
+        {
+            const uint32_t *p = (const uint32_t *)iptr;
+            for (x = 0; x < width; x++)
+                *o++ = index_of[p[x] & 0x7FFF];
+        }
+        iptr += bytesBetweenInputLines;
+    }
+}
+
+/* Gives every colour of the rect an index, returns 0 on overflow */
+static int add_colours(int x1, int y1, int x2, int y2)
+{
+    int bpp = screen->serverFormat.bitsPerPixel;
+    int x, y;
+
+    for (y = y1; y < y2; y++)
+    {
+        const char *line = screen->frameBuffer + y * screen->paddedWidthInBytes;
+
+        for (x = x1; x < x2; x++)
+        {
+            uint32_t c = (bpp == 16 ? ((const uint16_t *)line)[x] : ((const uint32_t *)line)[x]) & 0x7FFF;
+
+            if (index_of[c] != UNMAPPED)
+                continue;
+            if (ncolours == max_colours)
+                return 0;
+            colours[ncolours] = c;
+            index_of[c] = ncolours++;
+        }
+    }
+    return 1;
+}
+
+/* Rebuilds the map from the whole screen */
+static void recount(void)
+{
+    memset(index_of, 0xFF, 32768 * sizeof(uint16_t));
+    ncolours = 0;
+    sent_colours = 0;
+    overflow = !add_colours(0, 0, screen->width, screen->height);
+    stale = 0;
+    recount_at = time(NULL) + RECOUNT_INTERVAL;
+    if (overflow)
+        debug_print("palette overflow, more than %d colours\n", max_colours);
+}
+
+/* Tracks the colours of a rect that has just changed */
+void palette_scan(int x1, int y1, int x2, int y2)
+{
+    if (screen == NULL || stale || overflow)
+        return;
+    if (!add_colours(x1, y1, x2, y2))
+    {
+        overflow = 1;
+        recount_at = time(NULL) + RECOUNT_INTERVAL;
+        debug_print("palette overflow, more than %d colours\n", max_colours);
+    }
+}
+
+static rfbBool send_colour_map(rfbClientPtr cl, int first, int n)
+{
+    char buf[sz_rfbSetColourMapEntriesMsg + 256 * 3 * 2];
+    rfbSetColourMapEntriesMsg *msg = (rfbSetColourMapEntriesMsg *)buf;
+    uint16_t *rgb = (uint16_t *)(buf + sz_rfbSetColourMapEntriesMsg);
+    rfbPixelFormat *f = &screen->serverFormat;
+    int i;
+
+    msg->type = rfbSetColourMapEntries;
+    msg->pad = 0;
+    msg->firstColour = Swap16IfLE(first);
+    msg->nColours = Swap16IfLE(n);
+    for (i = 0; i < n; i++)
+    {
+        uint32_t c = colours[first + i];
+        rgb[i * 3 + 0] = Swap16IfLE(((c >> f->redShift) & 31) * 65535 / 31);
+        rgb[i * 3 + 1] = Swap16IfLE(((c >> f->greenShift) & 31) * 65535 / 31);
+        rgb[i * 3 + 2] = Swap16IfLE(((c >> f->blueShift) & 31) * 65535 / 31);
+    }
+
+    if (rfbWriteExact(cl, buf, sz_rfbSetColourMapEntriesMsg + n * 3 * 2) < 0)
+    {
+        rfbLogPerror("send_colour_map: write");
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+    rfbStatRecordMessageSent(cl, rfbSetColourMapEntries,
+                             sz_rfbSetColourMapEntriesMsg + n * 3 * 2,
+                             sz_rfbSetColourMapEntriesMsg + n * 3 * 2);
+    return TRUE;
+}
+
+static void refresh_all(rfbClientPtr cl)
+{
+    sraRegionPtr all = sraRgnCreateRect(0, 0, screen->width, screen->height);
+
+    sraRgnOr(cl->modifiedRegion, all);
+    sraRgnDestroy(all);
+}
+
+/* The true colour format libvncserver serves a colour-mapped client in */
+static int is_bgr233(const rfbPixelFormat *f)
+{
+    return f->trueColour && f->bitsPerPixel == 8 && f->redMax == 7 && f->greenMax == 7 &&
+           f->blueMax == 3 && f->redShift == 0 && f->greenShift == 3 && f->blueShift == 6;
+}
+
+static int wants_palette(rfbClientPtr cl)
+{
+    struct palette_client *pc = rfbGetExtensionClientData(cl, &palette_extension);
+
+    return pc != NULL && pc->colour_mapped && cl->scaledScreen == cl->screen;
+}
+
+/* cl->format stays the client's, the map replaces BGR233 */
+static int adopt(rfbClientPtr cl)
+{
+    if (!send_colour_map(cl, 0, ncolours))
+        return 0;
+    cl->translateFn = palette_translate;
+    refresh_all(cl);
+    return 1;
+}
+
+/* Back to BGR233, whose map libvncserver sends for a colour-mapped format only */
+static void drop(rfbClientPtr cl)
+{
+    struct palette_client *pc = rfbGetExtensionClientData(cl, &palette_extension);
+
+    if (pc != NULL && pc->colour_mapped)
+        cl->format.trueColour = FALSE;
+    rfbSetTranslateFunction(cl);
+    refresh_all(cl);
+}
+
+/*
+ * Replaces libvncserver's choice for colour-mapped clients while the map
+ * fits. The format asked for is kept before libvncserver swaps it for
+ * BGR233; BGR233 again (a new framebuffer) is the swap, not a new request.
+ */
+static rfbBool palette_set_translate(rfbClientPtr cl)
+{
+    struct palette_client *pc = rfbGetExtensionClientData(cl, &palette_extension);
+
+    if (pc != NULL && !(pc->colour_mapped && is_bgr233(&cl->format)))
+        pc->colour_mapped = !cl->format.trueColour && cl->format.bitsPerPixel == 8;
+    if (!wants_palette(cl))
+        return rfbSetTranslateFunction(cl);
+
+    if (stale)
+        recount();
+    if (overflow)
+        return rfbSetTranslateFunction(cl);
+    if (!adopt(cl))
+        return FALSE;
+    sent_colours = ncolours;
+    return TRUE;
+}
+
+/*
+ * Brings the palette clients up to date before the changes found by a
+ * capture go out: new map entries, a fall back to BGR233 on overflow, or
+ * back onto the map after a recount.
+ */
+void palette_commit(void)
+{
+    rfbClientIteratorPtr it;
+    rfbClientPtr cl;
+    int users = 0, waiting = 0;
+
+    if (screen == NULL)
+        return;
+
+    it = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(it)) != NULL)
+    {
+        if (cl->sock < 0)
+            continue;
+
+        if (cl->translateFn == palette_translate)
+        {
+            if (overflow || !wants_palette(cl))
+            {
+                drop(cl);
+                waiting += wants_palette(cl);
+            }
+            else if (ncolours > sent_colours && !send_colour_map(cl, sent_colours, ncolours - sent_colours))
+                continue;
+            else
+                users++;
+        }
+        else if (wants_palette(cl))
+        {
+            waiting++;
+        }
+    }
+    rfbReleaseClientIterator(it);
+
+    sent_colours = ncolours;
+    if (users == 0 && waiting == 0)
+    {
+        stale = 1;
+        return;
+    }
+
+    if (waiting > 0 && (stale || (overflow && time(NULL) >= recount_at)) && users == 0)
+    {
+        recount();
+        if (overflow)
+            return;
+
+        it = rfbGetClientIterator(screen);
+        while ((cl = rfbClientIteratorNext(it)) != NULL)
+        {
+            if (cl->sock >= 0 && cl->translateFn != palette_translate && wants_palette(cl))
+                adopt(cl);
+        }
+        rfbReleaseClientIterator(it);
+        sent_colours = ncolours;
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+int init_palette(rfbScreenInfoPtr screen, int max_colours);
+void cleanup_palette();
+
+void palette_scan(int x1, int y1, int x2, int y2);
+void palette_commit(void);
+
+#endif //PALETTE_H
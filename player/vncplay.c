@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "../recfile.h"
+
+/*
+ * Plays a recording of vncsrv: prints the sessions and the input of the
+ * operators with their times, and with -o writes the screen as PPM images
+ * at every key or button press and every -i seconds in between.
+ */
+
+#define IN_CHUNK 65536
+
+static FILE *in;
+static z_stream zs;
+static unsigned char inbuf[IN_CHUNK];
+static int stream_end;
+
+static int width, height, bytespp;
+static int red_max, green_max, blue_max;
+static int red_shift, green_shift, blue_shift;
+static unsigned char *screen;
+static time_t start_time;
+
+static const char *out_dir;
+static int frame_interval = 10;
+static int frames;
+
+static uint32_t get16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get24(const unsigned char *p)
+{
+    return get16(p) | p[2] << 16;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return get16(p) | get16(p + 2) << 16;
+}
+
+/* Inflates exactly len bytes, returns 0 at the end of the recording */
+static int get(void *data, size_t len)
+{
+    zs.next_out = data;
+    zs.avail_out = len;
+    while (zs.avail_out > 0)
+    {
+        int ret;
+
+        if (stream_end)
+            return 0;
+        if (zs.avail_in == 0)
+        {
+            zs.avail_in = fread(inbuf, 1, IN_CHUNK, in);
+            zs.next_in = inbuf;
+            /* a recording cut off by a power loss ends at its last flush */
+            if (zs.avail_in == 0)
+                return 0;
+        }
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            stream_end = 1;
+        else if (ret != Z_OK)
+        {
+            fprintf(stderr, "corrupt recording: %s\n", zs.msg != NULL ? zs.msg : "?");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int get_host(char *host)
+{
+    unsigned char len;
+
+    if (!get(&len, 1) || !get(host, len))
+        return 0;
+    host[len] = '\0';
+    return 1;
+}
+
+static void print_time(uint32_t ms)
+{
+    time_t t = start_time + ms / 1000;
+    char buf[32];
+
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("%s.%03u ", buf, ms % 1000);
+}
+
+static int scale(uint32_t v, int shift, int max)
+{
+    return max > 0 ? ((v >> shift) & max) * 255 / max : 0;
+}
+
+static void write_frame(uint32_t ms)
+{
+    char path[4096];
+    FILE *f;
+    int i;
+
+    if (out_dir == NULL)
+        return;
+
+    /* frames of the same millisecond are told apart by their number */
+    snprintf(path, sizeof(path), "%s/%010u.%03u-%06d.ppm", out_dir,
+             (unsigned)(start_time + ms / 1000), ms % 1000, frames);
+    f = fopen(path, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "cannot write %s\n", path);
+        return;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    for (i = 0; i < width * height; i++)
+    {
+        const unsigned char *p = screen + i * bytespp;
+        uint32_t v = bytespp == 1 ? p[0] : bytespp == 2 ? get16(p) : bytespp == 3 ? get24(p) : get32(p);
+
+        fputc(scale(v, red_shift, red_max), f);
+        fputc(scale(v, green_shift, green_max), f);
+        fputc(scale(v, blue_shift, blue_max), f);
+    }
+    fclose(f);
+    frames++;
+}
+
+static int read_header(void)
+{
+    unsigned char head[RECORD_HEADER_SIZE];
+
+    if (fread(head, 1, sizeof(head), in) != sizeof(head) || memcmp(head, RECORD_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "not a vncsrv recording\n");
+        return 0;
+    }
+    start_time = get32(head + 8);
+    width = get16(head + 12);
+    height = get16(head + 14);
+    bytespp = head[16] / 8;
+    red_max = get16(head + 18);
+    green_max = get16(head + 20);
+    blue_max = get16(head + 22);
+    red_shift = head[24];
+    green_shift = head[25];
+    blue_shift = head[26];
+
+    if (bytespp < 1 || bytespp > 4)
+    {
+        fprintf(stderr, "unsupported %d bits per pixel\n", head[16]);
+        return 0;
+    }
+    screen = calloc(width * height, bytespp);
+    return screen != NULL;
+}
+
+static int play(void)
+{
+    unsigned char rec[9];
+    char host[256];
+    uint32_t next_frame = 0, ms = 0;
+
+    if (!read_header() || inflateInit(&zs) != Z_OK)
+        return 1;
+
+    print_time(0);
+    printf("recording %dx%d\n", width, height);
+
+    while (get(rec, 5))
+    {
+        ms = get32(rec + 1);
+
+        switch (rec[0])
+        {
+        case RECORD_UPDATE:
+        {
+            int x, y, w, h, j;
+
+            if (!get(rec, 8))
+                break;
+            x = get16(rec);
+            y = get16(rec + 2);
+            w = get16(rec + 4);
+            h = get16(rec + 6);
+            if (x + w > width || y + h > height)
+            {
+                fprintf(stderr, "update out of the screen\n");
+                return 1;
+            }
+            for (j = 0; j < h; j++)
+            {
+                if (!get(screen + ((y + j) * width + x) * bytespp, w * bytespp))
+                    break;
+            }
+            if (ms >= next_frame)
+            {
+                write_frame(ms);
+                next_frame = ms + frame_interval * 1000;
+            }
+            break;
+        }
+        case RECORD_KEY:
+            if (!get(rec, 5) || !get_host(host))
+                break;
+            print_time(ms);
+            printf("%s key 0x%04x %s\n", host, get32(rec + 1), rec[0] ? "down" : "up");
+            if (rec[0])
+                write_frame(ms);
+            break;
+        case RECORD_POINTER:
+            if (!get(rec, 5) || !get_host(host))
+                break;
+            print_time(ms);
+            printf("%s pointer %d,%d buttons 0x%02x\n", host, get16(rec + 1), get16(rec + 3), rec[0]);
+            if (rec[0])
+                write_frame(ms);
+            break;
+        case RECORD_CLIENT:
+            if (!get(rec, 1) || !get_host(host))
+                break;
+            print_time(ms);
+            printf("%s %s\n", host, rec[0] ? "connected" : "disconnected");
+            break;
+        default:
+            fprintf(stderr, "unknown record 0x%02x\n", rec[0]);
+            return 1;
+        }
+    }
+
+    write_frame(ms);
+    print_time(ms);
+    printf("end, %d frames written\n", frames);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-o dir] [-i seconds] recording\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int i, ret;
+
+    for (i = 1; i < argc - 1 && argv[i][0] == '-'; i += 2)
+    {
+        if (strcmp(argv[i], "-o") == 0)
+            out_dir = argv[i + 1];
+        else if (strcmp(argv[i], "-i") == 0)
+            frame_interval = atoi(argv[i + 1]);
+        else
+            break;
+    }
+    if (i != argc - 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    in = fopen(argv[i], "rb");
+    if (in == NULL)
+    {
+        perror(argv[i]);
+        return 1;
+    }
+    ret = play();
+    fclose(in);
+    return ret;
+}
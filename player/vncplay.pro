@@ -0,0 +1,10 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+QT -= gui
+CONFIG  -= QT
+CONFIG -= core
+
+SOURCES += vncplay.c
+
+LIBS += -lz
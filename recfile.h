@@ -0,0 +1,28 @@
+#ifndef RECFILE_H
+#define RECFILE_H
+
+/*
+ * A recording file starts with a RECORD_HEADER_SIZE byte header, all numbers
+ * little endian:
+ *   0 magic RECORD_MAGIC, 8 u32 start time (unix seconds),
+ *   12 u16 width, 14 u16 height, 16 u8 bits per pixel, 17 u8 depth,
+ *   18 u16 red max, 20 u16 green max, 22 u16 blue max,
+ *   24 u8 red shift, 25 u8 green shift, 26 u8 blue shift, 27 u8 true colour
+ * followed by a zlib stream of records, each starting with a u8 type and
+ * a u32 ms since the start time:
+ *   RECORD_UPDATE  u16 x, y, w, h, w * h pixels as the screen holds them
+ *   RECORD_KEY     u8 down, u32 keysym, u8 length, client host
+ *   RECORD_POINTER u8 buttons, u16 x, y, u8 length, client host
+ *   RECORD_CLIENT  u8 connected, u8 length, client host
+ */
+
+#define RECORD_MAGIC "VNCREC1\n"
+#define RECORD_HEADER_SIZE 28
+
+/* Record types of the compressed stream */
+#define RECORD_UPDATE  'U'
+#define RECORD_KEY     'K'
+#define RECORD_POINTER 'P'
+#define RECORD_CLIENT  'C'
+
+#endif //RECFILE_H
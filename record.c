@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+/*
+ * include/zlib.h is the copy from Qt, which renames the API to z_*; vncsrv
+ * links the system libz as libvncserver does
+ */
+#define z_deflate deflate
+#define z_deflateEnd deflateEnd
+#define z_deflateInit_ deflateInit_
+
+/* libvncserver */
+#include "rfb/rfb.h"
+
+#include "zlib.h"
+#include "record.h"
+#include "logging.h"
+
+/*
+ * Session recording for the audit trail: the rects sent to the clients and
+ * the input injected for them, deflated into one stream per file and
+ * written in OUT_CHUNK blocks. A file that grows over half of the limit is
+ * finished and moved to <path>.1, replacing the previous one, and the next
+ * file starts with the whole screen. The format is in recfile.h, vncplay
+ * in player/ plays it.
+ */
+
+#define OUT_CHUNK 65536
+/* seconds the compressor may hold records back */
+#define FLUSH_INTERVAL 30
+#define MIN_RECORD_KB 256
+
+static rfbScreenInfoPtr screen;
+static char *record_path;
+static long max_bytes;
+static int fd = -1;
+static z_stream zs;
+static unsigned char out[OUT_CHUNK];
+static int pending;          /* bytes of out not written yet */
+static long written;         /* bytes of the current file */
+static struct timespec started;
+static time_t flushed_at;
+
+static void start_file(void);
+
+static void put16(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static void stop_recording(void)
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    deflateEnd(&zs);
+}
+
+static void write_out(void)
+{
+    if (pending > 0 && write(fd, out, pending) != pending)
+    {
+        error_print("cannot write %s, recording stopped\n", record_path);
+        stop_recording();
+    }
+    written += pending;
+    pending = 0;
+}
+
+static void put(const void *data, int len, int flush)
+{
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    for (;;)
+    {
+        zs.next_out = out + pending;
+        zs.avail_out = OUT_CHUNK - pending;
+        deflate(&zs, flush);
+        pending = OUT_CHUNK - zs.avail_out;
+        /* done once deflate had room left */
+        if (zs.avail_out > 0 && zs.avail_in == 0)
+            break;
+        write_out();
+        if (fd < 0)
+            return;
+    }
+    if (flush != Z_NO_FLUSH)
+        write_out();
+}
+
+/* Type and time of a record, returns the header length */
+static int record_head(unsigned char *p, int type)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - started.tv_sec) * 1000 + (now.tv_nsec - started.tv_nsec) / 1000000;
+    p[0] = type;
+    put32(p + 1, ms);
+    return 5;
+}
+
+static int put_host(unsigned char *p, rfbClientPtr cl)
+{
+    int len = cl->host != NULL ? strlen(cl->host) : 0;
+
+    if (len > 255)
+        len = 255;
+    p[0] = len;
+    if (len > 0)
+        memcpy(p + 1, cl->host, len);
+    return 1 + len;
+}
+
+/* The current file becomes the previous one */
+static void next_file(void)
+{
+    char old[PATH_MAX];
+
+    put(NULL, 0, Z_FINISH);
+    stop_recording();
+    snprintf(old, sizeof(old), "%s.1", record_path);
+    if (rename(record_path, old) != 0)
+        error_print("cannot rename %s\n", record_path);
+    start_file();
+}
+
+/* Ends the file when it is full, pushes out what is held back for long */
+static void record_done(void)
+{
+    if (fd < 0)
+        return;
+
+    if (written + pending > max_bytes / 2)
+    {
+        next_file();
+    }
+    else if (time(NULL) >= flushed_at + FLUSH_INTERVAL)
+    {
+        put(NULL, 0, Z_SYNC_FLUSH);
+        flushed_at = time(NULL);
+    }
+}
+
+static void write_update(int x1, int y1, int x2, int y2)
+{
+    unsigned char head[13];
+    int bpp = screen->serverFormat.bitsPerPixel / 8;
+    int y;
+
+    record_head(head, RECORD_UPDATE);
+    put16(head + 5, x1);
+    put16(head + 7, y1);
+    put16(head + 9, x2 - x1);
+    put16(head + 11, y2 - y1);
+    put(head, sizeof(head), Z_NO_FLUSH);
+
+    for (y = y1; y < y2 && fd >= 0; y++)
+        put(screen->frameBuffer + y * screen->paddedWidthInBytes + x1 * bpp, (x2 - x1) * bpp, Z_NO_FLUSH);
+}
+
+static void start_file(void)
+{
+    unsigned char head[RECORD_HEADER_SIZE];
+    rfbPixelFormat *f = &screen->serverFormat;
+
+    fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0)
+    {
+        error_print("cannot open %s, not recording\n", record_path);
+        return;
+    }
+    if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK)
+    {
+        error_print("cannot init recording compressor\n");
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    flushed_at = time(NULL);
+
+    memcpy(head, RECORD_MAGIC, 8);
+    put32(head + 8, time(NULL));
+    put16(head + 12, screen->width);
+    put16(head + 14, screen->height);
+    head[16] = f->bitsPerPixel;
+    head[17] = f->depth;
+    put16(head + 18, f->redMax);
+    put16(head + 20, f->greenMax);
+    put16(head + 22, f->blueMax);
+    head[24] = f->redShift;
+    head[25] = f->greenShift;
+    head[26] = f->blueShift;
+    head[27] = f->trueColour;
+    if (write(fd, head, sizeof(head)) != sizeof(head))
+    {
+        error_print("cannot write %s, not recording\n", record_path);
+        stop_recording();
+        return;
+    }
+    written = sizeof(head);
+    pending = 0;
+
+    /* every file can be played on its own */
+    write_update(0, 0, screen->width, screen->height);
+}
+
+int init_record(rfbScreenInfoPtr s, const char *path, int max_kb)
+{
+    if (path == NULL || path[0] == '\0')
+        return 0;
+
+    screen = s;
+    record_path = strdup(path);
+    if (max_kb < MIN_RECORD_KB)
+        max_kb = MIN_RECORD_KB;
+    max_bytes = max_kb * 1024L;
+
+    start_file();
+    if (fd < 0)
+        return 0;
+    info_print("recording to %s\n", record_path);
+    return 1;
+}
+
+void cleanup_record()
+{
+    if (fd >= 0)
+    {
+        put(NULL, 0, Z_FINISH);
+        stop_recording();
+    }
+    free(record_path);
+    record_path = NULL;
+}
+
+/* The screen has a new size or format, which only a new file can tell */
+void record_resized(void)
+{
+    if (fd >= 0)
+        next_file();
+}
+
+/* A rect of the screen as it goes to the clients */
+void record_update(int x1, int y1, int x2, int y2)
+{
+    if (fd < 0)
+        return;
+    write_update(x1, y1, x2, y2);
+    record_done();
+}
+
+void record_key(rfbClientPtr cl, int down, uint32_t keysym)
+{
+    unsigned char rec[5 + 5 + 256];
+    int len;
+
+    if (fd < 0)
+        return;
+    len = record_head(rec, RECORD_KEY);
+    rec[len++] = down;
+    put32(rec + len, keysym);
+    len += 4;
+    len += put_host(rec + len, cl);
+    put(rec, len, Z_NO_FLUSH);
+    record_done();
+}
+
+void record_pointer(rfbClientPtr cl, int buttons, int x, int y)
+{
+    unsigned char rec[5 + 5 + 256];
+    int len;
+
+    if (fd < 0)
+        return;
+    len = record_head(rec, RECORD_POINTER);
+    rec[len++] = buttons;
+    put16(rec + len, x);
+    put16(rec + len + 2, y);
+    len += 4;
+    len += put_host(rec + len, cl);
+    put(rec, len, Z_NO_FLUSH);
+    record_done();
+}
+
+/* Sessions coming and going, the end of one is pushed out at once */
+void record_client(rfbClientPtr cl, int connected)
+{
+    unsigned char rec[5 + 1 + 256];
+    int len;
+
+    if (fd < 0)
+        return;
+    len = record_head(rec, RECORD_CLIENT);
+    rec[len++] = connected;
+    len += put_host(rec + len, cl);
+    put(rec, len, connected ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+    if (fd >= 0 && !connected)
+        flushed_at = time(NULL);
+    record_done();
+}
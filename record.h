@@ -0,0 +1,15 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "recfile.h"
+
+int init_record(rfbScreenInfoPtr screen, const char *path, int max_kb);
+void cleanup_record();
+
+void record_resized(void);
+void record_update(int x1, int y1, int x2, int y2);
+void record_key(rfbClientPtr cl, int down, uint32_t keysym);
+void record_pointer(rfbClientPtr cl, int buttons, int x, int y);
+void record_client(rfbClientPtr cl, int connected);
+
+#endif //RECORD_H
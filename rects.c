@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "rects.h"
+#include "logging.h"
+
+/* How many following rects are tried as a merge partner for each rect */
+#define MERGE_WINDOW 16
+
+static struct dirty_rect *rects;
+static int rects_alloc;
+
+/* Makes room for the rects of a display of tiles_x x tiles_y tiles */
+int init_rects(int tiles_x, int tiles_y)
+{
+    struct dirty_rect *p;
+
+    if (tiles_x * tiles_y <= rects_alloc)
+        return 1;
+    p = realloc(rects, tiles_x * tiles_y * sizeof(struct dirty_rect));
+    if (p == NULL)
+    {
+        error_print("cannot allocate dirty rects\n");
+        return 0;
+    }
+    rects = p;
+    rects_alloc = tiles_x * tiles_y;
+    return 1;
+}
+
+void cleanup_rects()
+{
+    free(rects);
+    rects = NULL;
+    rects_alloc = 0;
+}
+
+static int rect_area(const struct dirty_rect *r)
+{
+    return (r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static void rect_union(const struct dirty_rect *a, const struct dirty_rect *b, struct dirty_rect *u)
+{
+    u->x1 = a->x1 < b->x1 ? a->x1 : b->x1;
+    u->y1 = a->y1 < b->y1 ? a->y1 : b->y1;
+    u->x2 = a->x2 > b->x2 ? a->x2 : b->x2;
+    u->y2 = a->y2 > b->y2 ? a->y2 : b->y2;
+}
+
+static int rect_contains(const struct dirty_rect *a, const struct dirty_rect *b)
+{
+    return b->x1 >= a->x1 && b->x2 <= a->x2 && b->y1 >= a->y1 && b->y2 <= a->y2;
+}
+
+static int remove_rect(int n, int i)
+{
+    memmove(&rects[i], &rects[i + 1], (n - i - 1) * sizeof(struct dirty_rect));
+    return n - 1;
+}
+
+/*
+ * Reduces the dirty tile bitmap to a list of rectangles.
+ *
+ * Horizontal runs of dirty tiles are stacked into rects while consecutive
+ * rows have the same span. Then neighbouring rects are merged greedily,
+ * cheapest first, where the cost of a merge is the number of clean tiles the
+ * union would resend. Merging goes on while there are more than max_rects
+ * rects or while a merge wastes no more than max_waste tiles, which is what
+ * an extra rectangle header and encoder restart is worth.
+ *
+ * Tiles marked in hot_tiles (may be NULL) change on most captures; they
+ * are kept in rects of their own, so a clock or a blinking lamp is not
+ * resent with a big static neighbourhood every time. A hot and a cold rect
+ * are merged only when nothing else gets the count down to max_rects.
+ *
+ * Returns the number of rects, *rects points to internal storage.
+ */
+int build_dirty_rects(const unsigned char *dirty_tiles, int tiles_x, int tiles_y,
+                      const unsigned char *hot_tiles, int max_rects, int max_waste,
+                      struct dirty_rect **out)
+{
+    int n = 0;
+    int tx, ty, i, j;
+
+    for (ty = 0; ty < tiles_y; ty++)
+    {
+        const unsigned char *dirty = dirty_tiles + ty * tiles_x;
+        const unsigned char *hot = hot_tiles != NULL ? hot_tiles + ty * tiles_x : NULL;
+
+        tx = 0;
+        while (tx < tiles_x)
+        {
+            int start, is_hot;
+
+            if (!dirty[tx])
+            {
+                tx++;
+                continue;
+            }
+
+            start = tx;
+            is_hot = hot != NULL && hot[tx];
+            while (tx < tiles_x && dirty[tx] && (hot != NULL && hot[tx]) == is_hot)
+                tx++;
+
+            for (i = 0; i < n; i++)
+            {
+                if (rects[i].y2 == ty && rects[i].x1 == start && rects[i].x2 == tx &&
+                    rects[i].hot == is_hot)
+                {
+                    rects[i].y2 = ty + 1;
+                    break;
+                }
+            }
+
+            if (i == n)
+            {
+                rects[n].x1 = start;
+                rects[n].y1 = ty;
+                rects[n].x2 = tx;
+                rects[n].y2 = ty + 1;
+                rects[n].hot = is_hot;
+                n++;
+            }
+        }
+    }
+
+    while (n > 1)
+    {
+        int best_i = -1, best_j = -1;
+        int best_waste = INT_MAX;
+        struct dirty_rect u;
+
+        for (i = 0; i < n; i++)
+        {
+            int last = i + MERGE_WINDOW < n ? i + MERGE_WINDOW : n - 1;
+            for (j = i + 1; j <= last; j++)
+            {
+                int waste;
+                rect_union(&rects[i], &rects[j], &u);
+                waste = rect_area(&u) - rect_area(&rects[i]) - rect_area(&rects[j]);
+                if (rects[i].hot != rects[j].hot)
+                    waste += tiles_x * tiles_y;
+                if (waste < best_waste)
+                {
+                    best_waste = waste;
+                    best_i = i;
+                    best_j = j;
+                }
+            }
+        }
+
+        if (n <= max_rects && best_waste > max_waste)
+            break;
+
+        rect_union(&rects[best_i], &rects[best_j], &rects[best_i]);
+        rects[best_i].hot = rects[best_i].hot && rects[best_j].hot;
+        n = remove_rect(n, best_j);
+
+        /* The union may now cover other rects as well */
+        for (j = 0; j < n; j++)
+        {
+            if (j != best_i && rect_contains(&rects[best_i], &rects[j]))
+            {
+                rects[best_i].hot = rects[best_i].hot && rects[j].hot;
+                n = remove_rect(n, j);
+                if (j < best_i)
+                    best_i--;
+                j--;
+            }
+        }
+    }
+
+    *out = rects;
+    return n;
+}
@@ -0,0 +1,20 @@
+#ifndef RECTS_H
+#define RECTS_H
+
+/* Rectangle in tile units, x2 and y2 are exclusive */
+struct dirty_rect
+{
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+    int hot;  /* made of hot tiles only */
+};
+
+int init_rects(int tiles_x, int tiles_y);
+void cleanup_rects();
+int build_dirty_rects(const unsigned char *dirty_tiles, int tiles_x, int tiles_y,
+                      const unsigned char *hot_tiles, int max_rects, int max_waste,
+                      struct dirty_rect **rects);
+
+#endif //RECTS_H
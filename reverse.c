@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+
+#include "reverse.h"
+#include "evloop.h"
+#include "logging.h"
+
+/*
+ * Panels behind NAT cannot be reached on vnc_port, so they call out to a
+ * listening viewer or a repeater instead, the hosts of the list in turn.
+ * The connect does not block the event loop: a timer of this module looks
+ * at the connecting socket until it is up or given up. After every host of
+ * the list failed, or a session ended early, the next round waits twice as
+ * long, up to the configured maximum. TCP keepalive finds a dead cellular
+ * link and keeps the NAT mapping open while the screen is still. A session
+ * that comes back is answered from the keyframe at once, the shadow
+ * buffers are kept for it between sessions.
+ */
+
+#define MAX_HOSTS 8
+/* port of a viewer listening for reverse connections */
+#define DEFAULT_PORT 5500
+/* seconds to the first retry */
+#define MIN_BACKOFF 1
+/* seconds a connect may take */
+#define CONNECT_TIMEOUT 20
+/* a session this long was no failure, the next one is tried at once */
+#define STABLE_SESSION 60
+/* msec between looks at a connecting socket */
+#define CONNECT_POLL 100
+/* idle seconds, probe interval and probes of the keepalive */
+#define KEEPALIVE_IDLE 30
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_COUNT 3
+/* an UltraVNC repeater reads a zero padded "ID:" string of this size first */
+#define REPEATER_ID_SIZE 250
+
+struct reverse_host {
+    char name[256];
+    char port[8];
+    struct addrinfo *addr;   /* resolved, NULL - not yet */
+    struct addrinfo *tried;  /* address tried or connected, NULL - the first next */
+};
+
+static rfbScreenInfoPtr screen;
+static struct reverse_host hosts[MAX_HOSTS];
+static int nhosts;
+static int current;          /* host tried or connected */
+static int failed;           /* hosts failed since the last round began */
+static char repeater_id[REPEATER_ID_SIZE];
+static int max_backoff;
+static int backoff = MIN_BACKOFF;
+static int timer_fd = -1;
+static int sock = -1;        /* connect in progress */
+static rfbClientPtr client;  /* session up */
+static struct timespec started; /* of the connect or the session */
+
+static long seconds_since(const struct timespec *t)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - t->tv_sec;
+}
+
+static void arm_timer(long msec)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = msec / 1000;
+    its.it_value.tv_nsec = (msec % 1000) * 1000000L + 1;
+    timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+/* "host[:port]" or "[ipv6]:port" separated by commas or blanks */
+static int parse_hosts(const char *list)
+{
+    char buf[1024];
+    char *tok, *save, *colon, *end;
+
+    snprintf(buf, sizeof(buf), "%s", list);
+    nhosts = 0;
+    for (tok = strtok_r(buf, ", \t", &save); tok != NULL; tok = strtok_r(NULL, ", \t", &save))
+    {
+        struct reverse_host *h = &hosts[nhosts];
+
+        if (nhosts == MAX_HOSTS)
+        {
+            error_print("more than %d reverse hosts, %s ignored\n", MAX_HOSTS, tok);
+            continue;
+        }
+        colon = strrchr(tok, ':');
+        if (tok[0] == '[' && (end = strchr(tok, ']')) != NULL)
+        {
+            *end = '\0';
+            colon = end[1] == ':' ? end + 1 : NULL;
+            tok++;
+        }
+        else if (colon != NULL && strchr(tok, ':') != colon)
+        {
+            /* a bare IPv6 address, no port */
+            colon = NULL;
+        }
+        if (colon != NULL)
+        {
+            *colon = '\0';
+            snprintf(h->port, sizeof(h->port), "%s", colon + 1);
+        }
+        else
+            snprintf(h->port, sizeof(h->port), "%d", DEFAULT_PORT);
+        snprintf(h->name, sizeof(h->name), "%s", tok);
+        nhosts++;
+    }
+    return nhosts;
+}
+
+/*
+ * getaddrinfo() blocks the event loop, names are resolved when the list is
+ * read and again only after a whole round failed, a viewer on a dynamic
+ * address may have moved.
+ */
+static int resolve(struct reverse_host *h, const char **why)
+{
+    struct addrinfo hints;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    h->tried = NULL;
+    err = getaddrinfo(h->name, h->port, &hints, &h->addr);
+    if (err != 0)
+    {
+        h->addr = NULL;
+        *why = gai_strerror(err);
+        return 0;
+    }
+    return 1;
+}
+
+static void forget_addresses(void)
+{
+    int i;
+
+    for (i = 0; i < nhosts; i++)
+    {
+        if (hosts[i].addr != NULL)
+            freeaddrinfo(hosts[i].addr);
+        hosts[i].addr = NULL;
+        hosts[i].tried = NULL;
+    }
+}
+
+/* The next host, after a whole round of failures not before the backoff */
+static void next_host(void)
+{
+    current = (current + 1) % nhosts;
+    if (++failed < nhosts)
+    {
+        arm_timer(0);
+        return;
+    }
+    failed = 0;
+    forget_addresses();
+    /* a little jitter, so a fleet coming back after an outage spreads out */
+    arm_timer(backoff * 1000L + rand() % (backoff * 250L + 1));
+    info_print("reverse connection retried in %d s\n", backoff);
+    backoff *= 2;
+    if (backoff > max_backoff)
+        backoff = max_backoff;
+}
+
+/* A name may resolve to several addresses, the host is given up after the last */
+static void connect_failed(const char *why)
+{
+    struct reverse_host *h = &hosts[current];
+
+    error_print("reverse connection to %s:%s failed, %s\n", h->name, h->port, why);
+    if (sock >= 0)
+        close(sock);
+    sock = -1;
+    if (h->tried != NULL && h->tried->ai_next != NULL)
+    {
+        h->tried = h->tried->ai_next;
+        arm_timer(0);
+        return;
+    }
+    h->tried = NULL;
+    next_host();
+}
+
+static void start_connect(void)
+{
+    struct reverse_host *h = &hosts[current];
+    struct addrinfo *res;
+    const char *why;
+
+    if (h->addr == NULL && !resolve(h, &why))
+    {
+        connect_failed(why);
+        return;
+    }
+    if (h->tried == NULL)
+        h->tried = h->addr;
+    res = h->tried;
+
+    sock = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0 ||
+        (connect(sock, res->ai_addr, res->ai_addrlen) != 0 && errno != EINPROGRESS))
+    {
+        connect_failed(strerror(errno));
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    debug_print("connecting to %s:%s\n", h->name, h->port);
+    arm_timer(CONNECT_POLL);
+}
+
+static void set_keepalive(int fd)
+{
+    int one = 1, idle = KEEPALIVE_IDLE, intvl = KEEPALIVE_INTERVAL, cnt = KEEPALIVE_COUNT;
+
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* The socket is up, it becomes a client as rfbReverseConnection() makes one */
+static void connected(void)
+{
+    struct reverse_host *h = &hosts[current];
+    rfbClientPtr cl;
+
+    set_keepalive(sock);
+    if (repeater_id[0] != '\0' && write(sock, repeater_id, REPEATER_ID_SIZE) != REPEATER_ID_SIZE)
+    {
+        connect_failed("repeater did not take the ID");
+        return;
+    }
+
+    cl = rfbNewClient(screen, sock);
+    sock = -1;
+    if (cl == NULL)
+    {
+        connect_failed("client refused");
+        return;
+    }
+    cl->reverseConnection = TRUE;
+    evloop_add_clients(screen);
+
+    client = cl;
+    failed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    info_print("reverse connection to %s:%s\n", h->name, h->port);
+}
+
+static void check_connect(void)
+{
+    struct pollfd pfd = { sock, POLLOUT, 0 };
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (poll(&pfd, 1, 0) == 0)
+    {
+        if (seconds_since(&started) >= CONNECT_TIMEOUT)
+            connect_failed("timed out");
+        else
+            arm_timer(CONNECT_POLL);
+        return;
+    }
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+        err = errno;
+    if (err != 0)
+    {
+        connect_failed(strerror(err));
+        return;
+    }
+    connected();
+}
+
+static void reverse_tick(int fd, void *arg)
+{
+    uint64_t expirations;
+
+    (void)arg;
+    if (read(fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    if (client != NULL)
+        return;
+    if (sock >= 0)
+        check_connect();
+    else
+        start_connect();
+}
+
+/*
+ * After init_evloop(). hosts is the list to call, id an UltraVNC repeater
+ * ID or empty, retry_max the longest wait between rounds in seconds.
+ * Returns 1 if reverse connections are made.
+ */
+int init_reverse(rfbScreenInfoPtr s, const char *list, const char *id, int retry_max)
+{
+    int i;
+
+    screen = s;
+    if (list == NULL || parse_hosts(list) == 0)
+        return 0;
+
+    max_backoff = retry_max > MIN_BACKOFF ? retry_max : MIN_BACKOFF;
+    for (i = 0; i < nhosts; i++)
+    {
+        const char *why;
+
+        if (!resolve(&hosts[i], &why))
+            error_print("cannot resolve %s, %s\n", hosts[i].name, why);
+    }
+    if (id != NULL && id[0] != '\0')
+        snprintf(repeater_id, sizeof(repeater_id), "ID:%s", id);
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0 || !evloop_add_fd(timer_fd, reverse_tick, NULL))
+    {
+        error_print("cannot start reverse connections, %s\n", strerror(errno));
+        if (timer_fd >= 0)
+            close(timer_fd);
+        timer_fd = -1;
+        forget_addresses();
+        return 0;
+    }
+    srand(time(NULL) ^ getpid());
+    arm_timer(0);
+    info_print("reverse connections to %d host(s)\n", nhosts);
+    return 1;
+}
+
+void cleanup_reverse()
+{
+    if (timer_fd >= 0)
+    {
+        evloop_del_fd(timer_fd);
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    if (sock >= 0)
+        close(sock);
+    sock = -1;
+    client = NULL;
+    forget_addresses();
+    nhosts = 0;
+}
+
+/* From the client gone hook, a dropped session is called again */
+void reverse_client_gone(rfbClientPtr cl)
+{
+    if (cl != client || client == NULL)
+        return;
+    client = NULL;
+    info_print("reverse connection to %s:%s closed\n", hosts[current].name, hosts[current].port);
+
+    if (seconds_since(&started) >= STABLE_SESSION)
+    {
+        /* the link was good, the same host again at once */
+        backoff = MIN_BACKOFF;
+        failed = 0;
+        arm_timer(0);
+        return;
+    }
+    next_host();
+}
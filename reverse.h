@@ -0,0 +1,9 @@
+#ifndef REVERSE_H
+#define REVERSE_H
+
+int init_reverse(rfbScreenInfoPtr screen, const char *hosts, const char *id, int retry_max);
+void cleanup_reverse();
+
+void reverse_client_gone(rfbClientPtr cl);
+
+#endif //REVERSE_H
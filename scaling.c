@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+#include "rfb/rfbregion.h"
+
+#include "scaling.h"
+#include "logging.h"
+
+/*
+ * Scaled copies of the screen are libvncserver's: a client picks a scale
+ * with SetScale or the PalmVNC scale message and all clients at one scale
+ * share a copy. rfbMarkRectAsModified() refreshes the copies with a generic
+ * per pixel, per component filter; here whole-number factors of the
+ * 5 bits per sample format are box filtered with all three components of a
+ * pixel summed at once in one 32 bit word.
+ */
+
+/* 31 * MAX_FACTOR^2 has to fit the 10 bits each component gets in a sum */
+#define MAX_FACTOR 5
+
+/* not in rfb.h, scale.c of libvncserver */
+extern void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr,
+                                      int x0, int y0, int w0, int h0);
+
+/* 0x001F and 0x7C00 stay, 0x03E0 moves to bits 21-25, 5+ bit gaps between */
+static inline uint32_t spread(uint32_t p)
+{
+    return (p & 0x7C1F) | ((p & 0x03E0) << 16);
+}
+
+/* divides each component sum by the box area using a 16 bit reciprocal */
+static inline uint32_t gather(uint32_t sum, uint32_t recip)
+{
+    uint32_t a = (((sum >> 0) & 0x3FF) * recip) >> 16;
+    uint32_t b = (((sum >> 10) & 0x3FF) * recip) >> 16;
+    uint32_t c = (((sum >> 21) & 0x3FF) * recip) >> 16;
+
+    return a | (c << 5) | (b << 10);
+}
+
+static int is_box_format(rfbScreenInfoPtr screen)
+{
+    rfbPixelFormat *f = &screen->serverFormat;
+
+    if (f->bitsPerPixel != 16 && f->bitsPerPixel != 32)
+        return 0;
+    if (f->redMax != 31 || f->greenMax != 31 || f->blueMax != 31)
+        return 0;
+    /* the three components in bits 0-14, in any order */
+    return (1 << f->redShift | 1 << f->greenShift | 1 << f->blueShift) == (1 << 0 | 1 << 5 | 1 << 10);
+}
+
+/* Box filters the scaled pixels covering the screen rect [x1, x2) x [y1, y2) */
+static void box_filter(rfbScreenInfoPtr screen, rfbScreenInfoPtr scaled, int f,
+                       int x1, int y1, int x2, int y2)
+{
+    int sx1 = x1 / f, sy1 = y1 / f;
+    int sx2 = (x2 + f - 1) / f, sy2 = (y2 + f - 1) / f;
+    /* rounded up, exact for sums below 2^16 / area */
+    uint32_t recip = (65536 + f * f - 1) / (f * f);
+    uint32_t half = f * f / 2;
+    /* the rounding half is added to each of the three sums */
+    uint32_t bias = half | (half << 10) | (half << 21);
+    int sx, sy, i, j;
+
+    if (sx2 > scaled->width)
+        sx2 = scaled->width;
+    if (sy2 > scaled->height)
+        sy2 = scaled->height;
+
+    for (sy = sy1; sy < sy2; sy++)
+    {
+        const char *src = screen->frameBuffer + sy * f * screen->paddedWidthInBytes;
+        char *dst = scaled->frameBuffer + sy * scaled->paddedWidthInBytes;
+
+        if (screen->serverFormat.bitsPerPixel == 16)
+        {
+            for (sx = sx1; sx < sx2; sx++)
+            {
+                uint32_t sum = bias;
+                for (j = 0; j < f; j++)
+                {
+                    const uint16_t *s = (const uint16_t *)(src + j * screen->paddedWidthInBytes) + sx * f;
+                    for (i = 0; i < f; i++)
+                        sum += spread(s[i]);
+                }
+                ((uint16_t *)dst)[sx] = gather(sum, recip);
+            }
+        }
+        else
+        {
+            for (sx = sx1; sx < sx2; sx++)
+            {
+                uint32_t sum = bias;
+                for (j = 0; j < f; j++)
+                {
+                    const uint32_t *s = (const uint32_t *)(src + j * screen->paddedWidthInBytes) + sx * f;
+                    for (i = 0; i < f; i++)
+                        sum += spread(s[i]);
+                }
+                ((uint32_t *)dst)[sx] = gather(sum, recip);
+            }
+        }
+    }
+}
+
+/*
+ * Same as rfbMarkRectAsModified(), but the scaled copies are refreshed
+ * here. Factors that do not divide the screen exactly, or other formats,
+ * are left to libvncserver's filter.
+ */
+void mark_rect_modified(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
+{
+    rfbScreenInfoPtr scaled;
+    sraRegionPtr region;
+
+    for (scaled = screen->scaledScreenNext; scaled != NULL; scaled = scaled->scaledScreenNext)
+    {
+        int f = scaled->width > 0 ? screen->width / scaled->width : 0;
+
+        /* copies of departed clients stay allocated */
+        if (scaled->scaledScreenRefCount <= 0)
+            continue;
+
+        if (f >= 1 && f <= MAX_FACTOR &&
+            scaled->width * f == screen->width && scaled->height * f == screen->height &&
+            is_box_format(screen))
+            box_filter(screen, scaled, f, x1, y1, x2, y2);
+        else
+            rfbScaledScreenUpdateRect(screen, scaled, x1, y1, x2 - x1, y2 - y1);
+    }
+
+    region = sraRgnCreateRect(x1, y1, x2, y2);
+    rfbMarkRegionAsModified(screen, region);
+    sraRgnDestroy(region);
+}
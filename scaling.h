@@ -0,0 +1,6 @@
+#ifndef SCALING_H
+#define SCALING_H
+
+void mark_rect_modified(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
+
+#endif //SCALING_H
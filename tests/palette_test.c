@@ -0,0 +1,142 @@
+/*
+ * A colour-mapped client goes onto the live palette, falls back to BGR233
+ * on overflow and comes back after a recount. libvncserver is stood in for
+ * by the few calls palette.c makes; rfbSetTranslateFunction() swaps a
+ * colour-mapped format for BGR233 the way translate.c does.
+ */
+#include "../palette.c"
+
+int verbose;
+char rfbEndianTest = 1;
+
+static rfbProtocolExtension *registered;
+static void *client_data;
+static rfbClientPtr the_client;
+static int maps_sent;    /* SetColourMapEntries from palette.c */
+static int bgr233_sent;  /* colour maps from libvncserver */
+
+static void bgr233_translate(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
+                             char *iptr, char *optr, int bytesBetweenInputLines,
+                             int width, int height)
+{
+}
+
+rfbBool rfbSetTranslateFunction(rfbClientPtr cl)
+{
+    static const rfbPixelFormat bgr233 = { 8, 8, 0, 1, 7, 7, 3, 0, 3, 6, 0, 0 };
+
+    if (!cl->format.trueColour)
+    {
+        cl->format = bgr233;
+        bgr233_sent++;
+    }
+    cl->translateFn = bgr233_translate;
+    return TRUE;
+}
+
+void rfbRegisterProtocolExtension(rfbProtocolExtension *extension)
+{
+    registered = extension;
+}
+
+void *rfbGetExtensionClientData(rfbClientPtr cl, rfbProtocolExtension *extension)
+{
+    return extension == registered ? client_data : NULL;
+}
+
+int rfbWriteExact(rfbClientPtr cl, const char *buf, int len)
+{
+    maps_sent++;
+    return len;
+}
+
+void rfbLogPerror(const char *str) {}
+void rfbCloseClient(rfbClientPtr cl) {}
+void rfbStatRecordMessageSent(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw) {}
+
+sraRegionPtr sraRgnCreateRect(int x1, int y1, int x2, int y2) { return NULL; }
+void sraRgnOr(sraRegion *dst, const sraRegion *src) {}
+void sraRgnDestroy(sraRegionPtr rgn) {}
+
+static int iterated;
+rfbClientIteratorPtr rfbGetClientIterator(rfbScreenInfoPtr s) { iterated = 0; return NULL; }
+rfbClientPtr rfbClientIteratorNext(rfbClientIteratorPtr it) { return iterated++ ? NULL : the_client; }
+void rfbReleaseClientIterator(rfbClientIteratorPtr it) {}
+
+static int fails;
+
+#define CHECK(cond)                                        \
+    do                                                     \
+    {                                                      \
+        if (!(cond))                                       \
+        {                                                  \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            fails++;                                       \
+        }                                                  \
+    } while (0)
+
+/* colours distinct colours on a 16 x 16 screen of 15 bit pixels */
+static void paint(uint16_t *fb, int colours)
+{
+    int i;
+
+    for (i = 0; i < 16 * 16; i++)
+        fb[i] = i % colours * 97 & 0x7FFF;
+}
+
+int main(void)
+{
+    static rfbScreenInfo s;
+    static rfbClientRec cl;
+    static uint16_t fb[16 * 16];
+    static const rfbPixelFormat server_format = { 16, 15, 0, 1, 31, 31, 31, 0, 5, 10, 0, 0 };
+    static const rfbPixelFormat colour_mapped = { 8, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    s.serverFormat = server_format;
+    s.width = s.height = 16;
+    s.paddedWidthInBytes = 16 * 2;
+    s.frameBuffer = (char *)fb;
+    paint(fb, 16);
+    CHECK(init_palette(&s, 32));
+    CHECK(registered == &palette_extension);
+
+    cl.screen = cl.scaledScreen = &s;
+    cl.sock = 1;
+    the_client = &cl;
+    CHECK(palette_extension.newClient(&cl, &client_data));
+
+    /* SetPixelFormat of an 8 bit colour-mapped format */
+    cl.format = colour_mapped;
+    CHECK(s.setTranslateFunction(&cl));
+    CHECK(cl.translateFn == palette_translate);
+    CHECK(maps_sent == 1 && bgr233_sent == 0);
+    CHECK(ncolours == 16);
+
+    /* more colours than the map holds: BGR233 with libvncserver's map */
+    paint(fb, 64);
+    palette_scan(0, 0, 16, 16);
+    palette_commit();
+    CHECK(cl.translateFn == bgr233_translate);
+    CHECK(bgr233_sent == 1);
+
+    /* a new framebuffer sets the translation again, BGR233 is no new request */
+    CHECK(s.setTranslateFunction(&cl));
+    CHECK(wants_palette(&cl));
+
+    /* few enough colours again, the recount takes the client back */
+    paint(fb, 8);
+    recount_at = 0;
+    palette_commit();
+    CHECK(cl.translateFn == palette_translate);
+    CHECK(ncolours == 8);
+
+    /* a true colour format leaves the palette */
+    cl.format = server_format;
+    CHECK(s.setTranslateFunction(&cl));
+    CHECK(cl.translateFn == bgr233_translate && !wants_palette(&cl));
+
+    palette_extension.close(&cl, client_data);
+    cleanup_palette();
+    printf("palette_test: %d failed\n", fails);
+    return fails != 0;
+}
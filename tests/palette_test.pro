@@ -0,0 +1,13 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+QT -= gui
+CONFIG  -= QT
+CONFIG -= core
+
+DEFINES += _GNU_SOURCE
+
+INCLUDEPATH += ../include
+
+# built for the host and run there, libvncserver is stood in for
+SOURCES += palette_test.c
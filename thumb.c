@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <setjmp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+
+#include "thumb.h"
+#include "evloop.h"
+#include "logging.h"
+
+/*
+ * Small JPEG of the screen for dashboards, so nobody has to keep a VNC
+ * session open to poll pictures. It is written to a file every interval
+ * seconds and sent to whoever connects to a unix socket. It is made from
+ * the screen as the clients see it and encoded again only when a capture
+ * has changed the screen since the last one.
+ */
+
+/* socket clients waiting for the next snapshot */
+#define MAX_WAITING 8
+/* seconds a socket client gets to take the picture */
+#define SEND_TIMEOUT 1
+
+static rfbScreenInfoPtr screen;
+static char *thumb_file;
+static int thumb_width;
+static int thumb_quality;
+static int thumb_interval;
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int listen_fd = -1;
+static int waiting[MAX_WAITING];
+static int nwaiting;
+static struct timespec next_at;
+
+static unsigned long generation = 1;
+static unsigned long encoded_generation;
+static unsigned char *jpeg;
+static unsigned long jpeg_size;
+static unsigned long jpeg_alloc;
+
+/* libjpeg's own error_exit() ends the process, this one only the thumbnail */
+struct thumb_error
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void error_exit(j_common_ptr cinfo)
+{
+    struct thumb_error *err = (struct thumb_error *)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, msg);
+    error_print("thumbnail: %s\n", msg);
+    longjmp(err->jump, 1);
+}
+
+/* JPEG into the growing jpeg buffer, older libjpeg has no jpeg_mem_dest() */
+static void dest_init(j_compress_ptr cinfo)
+{
+    cinfo->dest->next_output_byte = jpeg;
+    cinfo->dest->free_in_buffer = jpeg_alloc;
+}
+
+static boolean dest_empty(j_compress_ptr cinfo)
+{
+    unsigned long used = jpeg_alloc;
+    unsigned char *p = realloc(jpeg, jpeg_alloc * 2);
+
+    if (p == NULL)
+        ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+    jpeg = p;
+    jpeg_alloc *= 2;
+    cinfo->dest->next_output_byte = jpeg + used;
+    cinfo->dest->free_in_buffer = jpeg_alloc - used;
+    return TRUE;
+}
+
+static void dest_term(j_compress_ptr cinfo)
+{
+    jpeg_size = jpeg_alloc - cinfo->dest->free_in_buffer;
+}
+
+/* Box filters f x f screen pixels into each RGB pixel of a thumbnail line */
+static void scale_line(unsigned char *rgb, int ty, int f, int tw)
+{
+    rfbPixelFormat *fmt = &screen->serverFormat;
+    int bpp = fmt->bitsPerPixel / 8;
+    int area = f * f;
+    int tx, x, y;
+
+    for (tx = 0; tx < tw; tx++)
+    {
+        uint32_t r = 0, g = 0, b = 0;
+
+        for (y = ty * f; y < (ty + 1) * f; y++)
+        {
+            const unsigned char *p = (const unsigned char *)screen->frameBuffer +
+                                     y * screen->paddedWidthInBytes + tx * f * bpp;
+
+            for (x = 0; x < f; x++, p += bpp)
+            {
+                /* 24 bit pixels are put together, a word read would be unaligned */
+                uint32_t v = bpp == 1 ? p[0] : bpp == 2 ? *(const uint16_t *)p :
+                             bpp == 3 ? (uint32_t)(p[0] | p[1] << 8 | p[2] << 16) : *(const uint32_t *)p;
+
+                r += (v >> fmt->redShift) & fmt->redMax;
+                g += (v >> fmt->greenShift) & fmt->greenMax;
+                b += (v >> fmt->blueShift) & fmt->blueMax;
+            }
+        }
+        *rgb++ = fmt->redMax ? r * 255 / fmt->redMax / area : 0;
+        *rgb++ = fmt->greenMax ? g * 255 / fmt->greenMax / area : 0;
+        *rgb++ = fmt->blueMax ? b * 255 / fmt->blueMax / area : 0;
+    }
+}
+
+static int encode(void)
+{
+    struct jpeg_compress_struct cinfo;
+    struct thumb_error jerr;
+    struct jpeg_destination_mgr dest;
+    int f = (screen->width + thumb_width - 1) / thumb_width;
+    int tw = screen->width / f;
+    int th = screen->height / f;
+    unsigned char *line;
+
+    if (f < 1)
+        f = 1;
+    line = malloc(tw * 3);
+    if (line == NULL)
+        return 0;
+    if (jpeg_alloc == 0)
+    {
+        jpeg_alloc = 16384;
+        jpeg = malloc(jpeg_alloc);
+        if (jpeg == NULL)
+        {
+            jpeg_alloc = 0;
+            free(line);
+            return 0;
+        }
+    }
+
+    cinfo.err = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit = error_exit;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_compress(&cinfo);
+        free(line);
+        return 0;
+    }
+    jpeg_create_compress(&cinfo);
+    dest.init_destination = dest_init;
+    dest.empty_output_buffer = dest_empty;
+    dest.term_destination = dest_term;
+    cinfo.dest = &dest;
+
+    cinfo.image_width = tw;
+    cinfo.image_height = th;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, thumb_quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = line;
+
+        scale_line(line, cinfo.next_scanline, f, tw);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(line);
+    return 1;
+}
+
+static void write_file(void)
+{
+    char tmp[PATH_MAX];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", thumb_file);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, jpeg, jpeg_size) != (ssize_t)jpeg_size)
+    {
+        error_print("cannot write %s\n", tmp);
+        if (fd >= 0)
+            close(fd);
+        unlink(tmp);
+        return;
+    }
+    close(fd);
+    if (rename(tmp, thumb_file) != 0)
+    {
+        error_print("cannot write %s\n", thumb_file);
+        unlink(tmp);
+    }
+}
+
+static void send_waiting(void)
+{
+    int i;
+
+    for (i = 0; i < nwaiting; i++)
+    {
+        if (write(waiting[i], jpeg, jpeg_size) != (ssize_t)jpeg_size)
+            debug_print("thumbnail not taken by socket client\n");
+        close(waiting[i]);
+    }
+    nwaiting = 0;
+}
+
+/* The picture is due on the next capture */
+static void thumb_accept(int fd, void *arg)
+{
+    struct timeval tv = { SEND_TIMEOUT, 0 };
+    int cfd;
+
+    (void)arg;
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+        if (nwaiting == MAX_WAITING)
+        {
+            close(cfd);
+            continue;
+        }
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        waiting[nwaiting++] = cfd;
+    }
+    evloop_schedule_capture(0);
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        error_print("thumbnail socket path %s is too long\n", path);
+        return 0;
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        error_print("cannot create thumbnail socket\n");
+        return 0;
+    }
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, MAX_WAITING) != 0 ||
+        !evloop_add_fd(listen_fd, thumb_accept, NULL))
+    {
+        error_print("cannot listen on %s\n", path);
+        close(listen_fd);
+        listen_fd = -1;
+        return 0;
+    }
+    strcpy(socket_path, path);
+    return 1;
+}
+
+/*
+ * Needs the event loop for the socket. Returns 1 if thumbnails are made,
+ * to a file or a socket or both.
+ */
+int init_thumb(rfbScreenInfoPtr s, const char *file, const char *path,
+               int width, int quality, int interval)
+{
+    screen = s;
+    thumb_width = width > 0 ? width : 1;
+    thumb_quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    thumb_interval = interval;
+
+    if (file != NULL && file[0] != '\0' && interval > 0)
+        thumb_file = strdup(file);
+    if (path != NULL && path[0] != '\0')
+        open_socket(path);
+    if (thumb_file == NULL && listen_fd < 0)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &next_at);
+    if (thumb_file != NULL)
+        info_print("thumbnail every %d s to %s\n", thumb_interval, thumb_file);
+    if (listen_fd >= 0)
+        info_print("thumbnail on request at %s\n", socket_path);
+    return 1;
+}
+
+void cleanup_thumb()
+{
+    send_waiting();
+    if (listen_fd >= 0)
+    {
+        evloop_del_fd(listen_fd);
+        close(listen_fd);
+        unlink(socket_path);
+        listen_fd = -1;
+    }
+    free(thumb_file);
+    thumb_file = NULL;
+    free(jpeg);
+    jpeg = NULL;
+    jpeg_alloc = 0;
+}
+
+/* A capture has changed the screen */
+void thumb_frame_changed(void)
+{
+    generation++;
+}
+
+static long usec_to_next(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (next_at.tv_sec - now.tv_sec) * 1000000L + (next_at.tv_nsec - now.tv_nsec) / 1000;
+}
+
+/* A socket client waits or the file is due */
+int thumb_due(void)
+{
+    return nwaiting > 0 || (thumb_file != NULL && usec_to_next() <= 0);
+}
+
+/* usec until the next picture is due, -1 if only the socket asks for them */
+long thumb_wait(void)
+{
+    long usec;
+
+    if (nwaiting > 0)
+        return 0;
+    if (thumb_file == NULL)
+        return -1;
+    usec = usec_to_next();
+    return usec > 0 ? usec : 0;
+}
+
+/* Called after a capture of the whole screen */
+void thumb_write(void)
+{
+    if (encoded_generation != generation)
+    {
+        if (!encode())
+        {
+            error_print("cannot encode thumbnail\n");
+            jpeg_size = 0;
+        }
+        else
+        {
+            encoded_generation = generation;
+            if (thumb_file != NULL)
+                write_file();
+        }
+    }
+
+    send_waiting();
+
+    if (thumb_file != NULL && usec_to_next() <= 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &next_at);
+        next_at.tv_sec += thumb_interval;
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef THUMB_H
+#define THUMB_H
+
+int init_thumb(rfbScreenInfoPtr screen, const char *file, const char *socket_path,
+               int width, int quality, int interval);
+void cleanup_thumb();
+
+void thumb_frame_changed(void);
+int thumb_due(void);
+long thumb_wait(void);
+void thumb_write(void);
+
+#endif //THUMB_H
@@ -6,13 +6,31 @@ CONFIG  -= QT
 CONFIG -= core
 CONFIG += DEBUG
 
+DEFINES += _GNU_SOURCE
+
 INCLUDEPATH += include
 
 SOURCES += main.c
 SOURCES += keyboard.c
 SOURCES += touch.c
 SOURCES += ini.c
+SOURCES += rects.c
+SOURCES += workers.c
+SOURCES += cpuctl.c
+SOURCES += evloop.c
+SOURCES += keyframe.c
+SOURCES += scaling.c
+SOURCES += continuous.c
+SOURCES += palette.c
+SOURCES += heat.c
+SOURCES += record.c
+SOURCES += thumb.c
+SOURCES += websock.c
+SOURCES += reverse.c
 
 
-LIBS += -Llib -lvncserver  -lresolv -lz -lgnutls -lgnutlsxx -lgnutls-openssl -lgcrypt -ljpeg -lgpg-error -ltasn1 -lp11 -lp11-kit -lnettle -lhogweed -lgmp -lgmpxx -lffi -lrt
+# only the libraries vncsrv calls into are loaded at start, libvncserver
+# brings its own (gnutls, gcrypt) and initialises TLS on a wss handshake
+QMAKE_LFLAGS += -Wl,--as-needed
+LIBS += -Llib -lvncserver  -lresolv -lz -lgnutls -lgnutlsxx -lgnutls-openssl -lgcrypt -ljpeg -lgpg-error -ltasn1 -lp11 -lp11-kit -lnettle -lhogweed -lgmp -lgmpxx -lffi -lrt -lpthread
 
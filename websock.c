@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* libvncserver */
+#include "rfb/rfb.h"
+
+#include "websock.h"
+#include "evloop.h"
+#include "logging.h"
+
+/*
+ * Browser access without a websockify proxy. libvncserver recognises a
+ * WebSocket handshake on any client socket it is given and frames the RFB
+ * stream itself, binary when the browser offers it; here it gets the
+ * connections of a port of their own, one firewalls let through. noVNC
+ * can be served from http_dir by libvncserver's HTTP server, whose sockets
+ * are driven from the event loop as well.
+ */
+
+static rfbScreenInfoPtr screen;
+static int ws_fd = -1;
+static int http_listen_fd = -1;
+static int http_fd = -1;  /* the connection libvncserver's HTTP server serves */
+
+static void ws_accept(int fd, void *arg)
+{
+    int sock, one = 1;
+
+    (void)arg;
+    while ((sock = accept(fd, NULL, NULL)) >= 0)
+    {
+        /* as rfbProcessNewConnection() prepares a socket */
+        if (!rfbSetNonBlocking(sock))
+        {
+            close(sock);
+            continue;
+        }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        /* the handshake is answered in there, the client is added then */
+        if (rfbNewClient(screen, sock) != NULL)
+            evloop_add_clients(screen);
+    }
+}
+
+/* Follows the one connection at a time the HTTP server keeps */
+static void http_check(int fd, void *arg)
+{
+    (void)fd;
+    (void)arg;
+
+    rfbHttpCheckFds(screen);
+
+    /* the connection may have been closed and the fd number given out again */
+    if (http_fd >= 0)
+        evloop_del_fd(http_fd);
+    http_fd = -1;
+    if (screen->httpSock >= 0 && evloop_add_fd(screen->httpSock, http_check, NULL))
+        http_fd = screen->httpSock;
+}
+
+/* Before rfbInitServer(), which opens the HTTP port */
+void websock_http(rfbScreenInfoPtr s, const char *http_dir, int http_port)
+{
+    if (http_dir == NULL || http_dir[0] == '\0' || http_port <= 0)
+        return;
+    s->httpDir = strdup(http_dir);
+    s->httpPort = http_port;
+}
+
+/* After init_evloop(), returns 0 if the WebSocket port cannot be opened */
+int init_websock(rfbScreenInfoPtr s, int port)
+{
+    screen = s;
+
+    if (screen->httpListenSock >= 0)
+    {
+        if (evloop_add_fd(screen->httpListenSock, http_check, NULL))
+        {
+            http_listen_fd = screen->httpListenSock;
+            info_print("serving %s on port %d\n", screen->httpDir, screen->httpPort);
+        }
+    }
+
+    if (port <= 0)
+        return 1;
+
+    ws_fd = rfbListenOnTCPPort(port, screen->listenInterface);
+    if (ws_fd < 0)
+    {
+        error_print("cannot listen on WebSocket port %d, %s\n", port, strerror(errno));
+        return 0;
+    }
+    if (!rfbSetNonBlocking(ws_fd) || !evloop_add_fd(ws_fd, ws_accept, NULL))
+    {
+        close(ws_fd);
+        ws_fd = -1;
+        return 0;
+    }
+    info_print("WebSocket clients on port %d\n", port);
+    return 1;
+}
+
+void cleanup_websock()
+{
+    if (ws_fd >= 0)
+    {
+        evloop_del_fd(ws_fd);
+        close(ws_fd);
+        ws_fd = -1;
+    }
+    if (http_fd >= 0)
+        evloop_del_fd(http_fd);
+    if (http_listen_fd >= 0)
+        evloop_del_fd(http_listen_fd);
+    http_fd = -1;
+    http_listen_fd = -1;
+}
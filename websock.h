@@ -0,0 +1,8 @@
+#ifndef WEBSOCK_H
+#define WEBSOCK_H
+
+void websock_http(rfbScreenInfoPtr screen, const char *http_dir, int http_port);
+int init_websock(rfbScreenInfoPtr screen, int port);
+void cleanup_websock();
+
+#endif //WEBSOCK_H
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "workers.h"
+#include "logging.h"
+
+/*
+ * Persistent pool: the pool threads are parked on start_barrier between
+ * jobs, so a run costs two barrier waits instead of thread creation.
+ * Normally the calling thread is worker 0; with offload all workers are
+ * pool threads, so they can be placed and scheduled apart from the caller.
+ */
+static pthread_t threads[MAX_WORKERS];
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t done_barrier;
+static worker_job_t current_job;
+static void (*thread_init)(void);
+static int nworkers = 1;
+static int first_thread = 1;
+static volatile int quit = 0;
+
+static void *worker_main(void *arg)
+{
+    int index = (int)(intptr_t)arg;
+
+    if (thread_init)
+        thread_init();
+
+    for (;;)
+    {
+        pthread_barrier_wait(&start_barrier);
+        if (quit)
+            break;
+        current_job(index, nworkers);
+        pthread_barrier_wait(&done_barrier);
+    }
+    return NULL;
+}
+
+int init_workers(int count, int offload, void (*init)(void))
+{
+    int i;
+
+    if (count < 1)
+        count = 1;
+    if (count > MAX_WORKERS)
+        count = MAX_WORKERS;
+
+    nworkers = count;
+    first_thread = offload ? 0 : 1;
+    thread_init = init;
+    quit = 0;
+    if (nworkers == first_thread)
+        return 1;
+
+    pthread_barrier_init(&start_barrier, NULL, nworkers - first_thread + 1);
+    pthread_barrier_init(&done_barrier, NULL, nworkers - first_thread + 1);
+
+    for (i = first_thread; i < nworkers; i++)
+    {
+        int ret = pthread_create(&threads[i], NULL, worker_main, (void *)(intptr_t)i);
+        if (ret != 0)
+        {
+            error_print("cannot start worker %d, %s\n", i, strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    info_print("scan workers: %d\n", nworkers);
+    return 1;
+}
+
+void cleanup_workers()
+{
+    int i;
+
+    if (nworkers == first_thread)
+        return;
+
+    quit = 1;
+    pthread_barrier_wait(&start_barrier);
+    for (i = first_thread; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&done_barrier);
+    nworkers = 1;
+    first_thread = 1;
+}
+
+void run_workers(worker_job_t job)
+{
+    current_job = job;
+
+    if (nworkers > first_thread)
+        pthread_barrier_wait(&start_barrier);
+
+    if (first_thread == 1)
+        job(0, nworkers);
+
+    if (nworkers > first_thread)
+        pthread_barrier_wait(&done_barrier);
+}
@@ -0,0 +1,13 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#define MAX_WORKERS 4
+
+/* Job run by every worker, index is 0..count-1 */
+typedef void (*worker_job_t)(int index, int count);
+
+int init_workers(int count, int offload, void (*init)(void));
+void cleanup_workers();
+void run_workers(worker_job_t job);
+
+#endif //WORKERS_H